@@ -0,0 +1,289 @@
+// -*- mode: c++ -*-
+/**
+   Replays an allocation trace against the hosted allocator.
+   \file
+
+   A trace is the AllocTrace::Log filled in after SetAllocTrace(), saved from the Amiga as it is in
+   memory: big-endian, with 32-bit pointers and 2-byte packing. Each heap is given as
+   address:size:attributes[:priority], using the Amiga addresses of the memory that was added with
+   AddMemList(), so that AllocAbs() lands in the same place and the addresses reported can be
+   compared with the trace:
+
+       script/replay [-s selection] [-l threshold] trace.log 0x400:0x7fc00:3 0x200000:0x800000:5:5
+
+   With -l, AllocMem() and FreeMem() calls of at least the threshold go through LargeObjects, as
+   they do in exec; without it, everything comes from the Heaps, so the two can be compared.
+
+   It reports the time per call, the worst and mean fragmentation seen (the fraction of the free
+   memory that isn't in the largest free Chunk), and every call whose outcome differed from the
+   trace.
+
+   Build it with "make script/replay".
+*/
+
+#include <exec/memory.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+using namespace exec;
+
+/** inserts a node in priority order; the ROM's version is in assembler, so isn't hosted
+    \param node_ the node to insert
+*/
+void List::enqueue(Node *node_) {
+    for(iterator i = begin(); i != end(); ++i)
+        if(i->priority < node_->priority)
+            return node_->insert_before(*i);
+    return push(node_);
+}
+
+namespace {
+    /// a record as it was traced, which may not be the host's layout
+    struct Traced {
+        uint16_t event;
+        uint32_t size;
+        uint32_t requirements;
+        uint32_t address;
+        uint32_t caller;
+        uint32_t time;
+    };
+
+    /// one heap to replay into
+    struct Zone {
+        uint32_t address;       //!< where it was on the Amiga
+        uint32_t size;
+        char *memory;           //!< where it is here
+        Heap *heap;
+    };
+
+    /// time spent on one kind of call
+    struct Timing {
+        const char *name;
+        uint64_t calls;
+        uint64_t ns;
+    };
+
+    const size_t RECORD_SIZE = 22;  // sizeof(AllocTrace::Record) on the Amiga
+    const size_t HEADER_SIZE = 12;  // sizeof(AllocTrace::Log)
+
+    uint32_t be16(const unsigned char *p) { return p[0] << 8 | p[1]; }
+    uint32_t be32(const unsigned char *p) { return uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3]; }
+
+    /** Reads a trace, oldest record first.
+        \param path the file to read
+        \param records where to put the records
+        \returns the number of records lost to the ring buffer wrapping, or -1 on error
+    */
+    long read_trace(const char *path, std::vector<Traced> &records) {
+        FILE *file = fopen(path, "rb");
+        if(!file)
+            return -1;
+        std::vector<unsigned char> data;
+        unsigned char buffer[4096];
+        for(size_t n; (n = fread(buffer, 1, sizeof buffer, file)) > 0; )
+            data.insert(data.end(), buffer, buffer + n);
+        fclose(file);
+        if(data.size() < HEADER_SIZE)
+            return -1;
+
+        uint32_t capacity = be32(&data[0]), next = be32(&data[4]), count = be32(&data[8]);
+        if(!capacity || next >= capacity || data.size() < HEADER_SIZE + capacity * RECORD_SIZE)
+            return -1;
+        uint32_t kept = count < capacity ? count : capacity;
+        uint32_t first = count < capacity ? 0 : next;
+        for(uint32_t i = 0; i < kept; ++i) {
+            const unsigned char *p = &data[HEADER_SIZE + (first + i) % capacity * RECORD_SIZE];
+            Traced record = {
+                uint16_t(be16(p)), be32(p + 2), be32(p + 6), be32(p + 10), be32(p + 14), be32(p + 18)
+            };
+            records.push_back(record);
+        }
+        return count - kept;
+    }
+
+    /** Parses address:size:attributes[:priority] and creates the Heap.
+        \returns true on success */
+    bool add_zone(const char *spec, HeapList &heaps, std::vector<Zone> &zones) {
+        char *end;
+        uint32_t field[4] = {0, 0, 0, 0};
+        int n = 0;
+        for(const char *p = spec; n < 4; p = end + 1) {
+            field[n++] = strtoul(p, &end, 0);
+            if(end == p || (*end && *end != ':'))
+                return false;
+            if(!*end)
+                break;
+        }
+        if(n < 3 || field[1] < 4096)
+            return false;
+        Zone zone = {field[0], field[1], static_cast<char *>(aligned_alloc(4096, field[1])), nullptr};
+        memset(zone.memory, 0, zone.size);
+        zone.heap = Heap::create(zone.size, Heap::Attributes(field[2]), field[3], zone.memory, spec);
+        heaps.add(zone.heap);
+        zones.push_back(zone);
+        return true;
+    }
+
+    /** \returns where an Amiga address is here, or nullptr if it isn't in any of the heaps */
+    char *translate(const std::vector<Zone> &zones, uint32_t address) {
+        for(const Zone &zone : zones)
+            if(address - zone.address < zone.size)
+                return zone.memory + (address - zone.address);
+        return nullptr;
+    }
+
+    int usage(void) {
+        fprintf(stderr, "usage: replay [-s priority|best-fit|spare-chip] [-l threshold] trace address:size:attributes[:priority]...\n");
+        return 2;
+    }
+}
+
+int main(int argc, char **argv) {
+    HeapList::Selection selection = HeapList::SELECT_PRIORITY;
+    uint32_t threshold = 0;
+    int arg = 1;
+    for(; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        const char *value = argv[arg + 1];
+        if(!strcmp(argv[arg], "-s")) {
+            if(!strcmp(value, "priority"))
+                selection = HeapList::SELECT_PRIORITY;
+            else if(!strcmp(value, "best-fit"))
+                selection = HeapList::SELECT_BEST_FIT;
+            else if(!strcmp(value, "spare-chip"))
+                selection = HeapList::SELECT_SPARE_CHIP;
+            else
+                return usage();
+        } else if(!strcmp(argv[arg], "-l")) {
+            threshold = strtoul(value, nullptr, 0);
+            if(threshold < LargeObjects::PAGE_SIZE)
+                return usage();
+        } else {
+            return usage();
+        }
+    }
+    if(argc - arg < 2)
+        return usage();
+
+    std::vector<Traced> records;
+    long lost = read_trace(argv[arg], records);
+    if(lost < 0) {
+        fprintf(stderr, "replay: can't read a trace from %s\n", argv[arg]);
+        return 1;
+    }
+    HeapList heaps;
+    std::vector<Zone> zones;
+    for(++arg; arg < argc; ++arg)
+        if(!add_zone(argv[arg], heaps, zones)) {
+            fprintf(stderr, "replay: bad heap %s\n", argv[arg]);
+            return usage();
+        }
+    LargeObjects large(&heaps);
+    large.set_threshold(threshold);
+
+    Timing timing[] = {
+        {"?", 0, 0}, {"AllocMem", 0, 0}, {"FreeMem", 0, 0}, {"AllocAbs", 0, 0},
+        {"AllocEntry", 0, 0}, {"FreeEntry", 0, 0},
+    };
+    std::unordered_map<uint32_t, char *> live;  // traced address to replayed address
+    size_t unmatched = 0, failures = 0;
+    double peak = 0, total = 0;
+    size_t peak_at = 0, peak_free = 0, peak_largest = 0, samples = 0;
+    typedef std::chrono::steady_clock Clock;
+
+    for(size_t i = 0; i < records.size(); ++i) {
+        const Traced &r = records[i];
+        if(r.event >= sizeof timing / sizeof timing[0] || !r.event)
+            continue;
+        bool freeing = r.event == AllocTrace::EVENT_FREE_MEM || r.event == AllocTrace::EVENT_FREE_ENTRY;
+        char *memory = nullptr;
+        Clock::time_point start;
+
+        if(freeing) {
+            auto found = live.find(r.address);
+            if(found == live.end()) {
+                // allocated before the trace starts, or failed during the replay
+                ++unmatched;
+                continue;
+            }
+            start = Clock::now();
+            if(r.event != AllocTrace::EVENT_FREE_MEM || !large.deallocate(found->second, r.size))
+                heaps.deallocate(found->second, r.size);
+            live.erase(found);
+        } else if(r.event == AllocTrace::EVENT_ALLOC_ABS) {
+            // only the address of a successful AllocAbs() is known
+            char *location = translate(zones, r.address);
+            if(!location)
+                continue;
+            start = Clock::now();
+            memory = heaps.allocate_at(location, r.size);
+            if(!memory && large.release(location, r.size))
+                memory = heaps.allocate_at(location, r.size);
+        } else {
+            Heap::Attributes attributes = Heap::Attributes(r.requirements);
+            Heap::Options options = Heap::Options(r.requirements >> 16);
+            start = Clock::now();
+            bool alloc_mem = r.event == AllocTrace::EVENT_ALLOC_MEM;
+            if(alloc_mem)
+                memory = large.allocate(r.size, attributes, options);
+            if(!memory)
+                memory = heaps.allocate(r.size, attributes, options, selection);
+            if(!memory && alloc_mem && large.release())
+                memory = heaps.allocate(r.size, attributes, options, selection);
+        }
+        timing[r.event].ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - start).count();
+        ++timing[r.event].calls;
+
+        if(!freeing) {
+            if(!memory != !r.address) {
+                ++failures;
+                printf("record %zu: %s of %u bytes, requirements 0x%x, from 0x%08x %s\n", i,
+                       timing[r.event].name, r.size, r.requirements, r.caller,
+                       memory ? "succeeded, but failed when traced" : "failed");
+            }
+            if(memory && r.address)
+                live[r.address] = memory;
+            else if(memory && !large.deallocate(memory, r.size))
+                heaps.deallocate(memory, r.size); // the program didn't get it, so won't free it
+        }
+
+        // the free extents count as free memory, but are only of use to large allocations
+        size_t free = large.available(Heap::MEMF_ANY, Heap::MEMF_NONE);
+        size_t largest = large.available(Heap::MEMF_ANY, Heap::MEMF_LARGEST);
+        for(const Zone &zone : zones) {
+            free += zone.heap->available();
+            zone.heap->flush(); // as an allocation that didn't fit would
+            size_t l = zone.heap->largest();
+            if(l > largest)
+                largest = l;
+        }
+        double fragmentation = free ? 1.0 - double(largest) / free : 0;
+        total += fragmentation;
+        ++samples;
+        if(fragmentation > peak) {
+            peak = fragmentation;
+            peak_at = i;
+            peak_free = free;
+            peak_largest = largest;
+        }
+    }
+
+    printf("%zu records replayed", records.size());
+    if(lost)
+        printf(", %ld lost to the ring buffer wrapping", lost);
+    printf(", %zu frees of memory allocated outside the trace\n", unmatched);
+    for(const Timing &t : timing)
+        if(t.calls)
+            printf("%-10s %10llu calls %8.1f ns/op\n", t.name, (unsigned long long)t.calls,
+                   double(t.ns) / t.calls);
+    printf("peak fragmentation %.1f%% at record %zu (%zu free, largest %zu), mean %.1f%%\n",
+           peak * 100, peak_at, peak_free, peak_largest,
+           samples ? total * 100 / samples : 0.0);
+    printf("%zu calls differed from the trace\n", failures);
+    return 0;
+}
@@ -0,0 +1,125 @@
+// -*- mode: c++ -*-
+/**
+   Measures MEMF_REVERSE allocation from a fragmented heap.
+   \file
+
+   The same memory is made into a heap twice: once with Heap::create(), which gives it an Index, and
+   once as a classic heap without one, which has to walk its whole Chunk list to find the highest
+   Chunk that fits. Each is fragmented the same way, by allocating small blocks from the bottom and
+   freeing every other one, and then makes the same reverse allocations and frees:
+
+       script/reverse [-m heap size in MiB] [-f blocks to fragment with] [-n reverse allocations]
+
+   It reports the free Chunks that each ended up with and the time that the reverse allocations
+   took.
+
+   Build it with "make script/reverse".
+*/
+
+#include <exec/memory.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace exec;
+
+/** inserts a node in priority order; the ROM's version is in assembler, so isn't hosted
+    \param node_ the node to insert
+*/
+void List::enqueue(Node *node_) {
+    for(iterator i = begin(); i != end(); ++i)
+        if(i->priority < node_->priority)
+            return node_->insert_before(*i);
+    return push(node_);
+}
+
+namespace {
+    const size_t FRAGMENT_SIZE = 200;   // size of the blocks that fragment the heap
+    const size_t REVERSE_SIZE = 128;    // size of the reverse allocations
+
+    /** Fragments a heap, then times reverse allocations from it, freeing every other one.
+        \param heap the heap
+        \param fragments the number of blocks to fragment it with
+        \param calls the number of reverse allocations
+        \param failures incremented for each reverse allocation that fails
+        \returns the time taken, in milliseconds
+    */
+    double run(Heap *heap, size_t fragments, size_t calls, size_t &failures) {
+        std::vector<char *> blocks;
+        while(blocks.size() < fragments)
+            if(char *memory = heap->allocate(FRAGMENT_SIZE))
+                blocks.push_back(memory);
+            else
+                break;
+        for(size_t i = 0; i < blocks.size(); i += 2)
+            heap->deallocate(blocks[i], FRAGMENT_SIZE);
+        heap->flush();
+
+        std::vector<char *> kept;
+        auto start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < calls; ++i) {
+            char *memory = heap->allocate_reverse(REVERSE_SIZE);
+            if(!memory)
+                ++failures;
+            else if(i % 2)
+                heap->deallocate(memory, REVERSE_SIZE);
+            else
+                kept.push_back(memory);
+        }
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+            .count();
+    }
+
+    int usage(void) {
+        fprintf(stderr,
+                "usage: reverse [-m heap size in MiB] [-f blocks to fragment with] "
+                "[-n reverse allocations]\n");
+        return 2;
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t megabytes = 8, fragments = 20000, calls = 5000;
+    for(int arg = 1; arg < argc; arg += 2) {
+        if(arg + 1 == argc)
+            return usage();
+        unsigned long value = strtoul(argv[arg + 1], nullptr, 0);
+        if(!value)
+            return usage();
+        if(!strcmp(argv[arg], "-m"))
+            megabytes = value;
+        else if(!strcmp(argv[arg], "-f"))
+            fragments = value;
+        else if(!strcmp(argv[arg], "-n"))
+            calls = value;
+        else
+            return usage();
+    }
+
+    size_t size = megabytes << 20;
+    char *memory = static_cast<char *>(aligned_alloc(4096, size));
+
+    size_t indexed_failures = 0;
+    Heap *indexed = Heap::create(size, Heap::MEMF_PUBLIC, 0, memory, "indexed");
+    double indexed_time = run(indexed, fragments, calls, indexed_failures);
+    size_t indexed_chunks = indexed->count_chunks();
+
+    // a classic heap is just the Heap at the start of its memory
+    size_t classic_failures = 0;
+    Heap *classic = new (memory) Heap(size - sizeof(Heap), Heap::MEMF_PUBLIC, 0,
+                                      memory + sizeof(Heap), "classic");
+    double classic_time = run(classic, fragments, calls, classic_failures);
+    size_t classic_chunks = classic->count_chunks();
+
+    printf("heap      free chunks    time (ms)\n");
+    printf("indexed %13zu %12.3f\n", indexed_chunks, indexed_time);
+    printf("classic %13zu %12.3f\n", classic_chunks, classic_time);
+    printf("speedup %26.1fx\n", classic_time / indexed_time);
+    if(indexed_failures || classic_failures)
+        printf("%zu and %zu reverse allocations failed\n", indexed_failures, classic_failures);
+
+    return indexed_failures || classic_failures;
+}
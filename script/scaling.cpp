@@ -0,0 +1,173 @@
+// -*- mode: c++ -*-
+/**
+   Measures how the hosted allocator scales with the number of threads using it.
+   \file
+
+   Each thread makes a mix of allocations and frees of random sizes, mostly small, through a
+   SharedHeapList: first with every call taking its lock, then with a SharedHeapList::Cache per
+   thread. This is repeated for 1, 2, 4 and so on up to the number of threads given:
+
+       script/scaling [-t threads] [-n calls per thread] [-m heap size in MiB]
+
+   It reports the calls per second in total for each, and checks that all of the memory comes back
+   once the threads have finished.
+
+   Build it with "make script/scaling".
+*/
+
+#include <exec/sharedheap.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using namespace exec;
+
+/** inserts a node in priority order; the ROM's version is in assembler, so isn't hosted
+    \param node_ the node to insert
+*/
+void List::enqueue(Node *node_) {
+    for(iterator i = begin(); i != end(); ++i)
+        if(i->priority < node_->priority)
+            return node_->insert_before(*i);
+    return push(node_);
+}
+
+namespace {
+    const size_t SLOTS = 512;   // blocks each thread may have allocated at once
+
+    /// one thread's blocks
+    struct Block {
+        char *memory;
+        size_t size;
+    };
+
+    /** \returns the next number from a thread's xorshift generator */
+    uint32_t next(uint32_t &state) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    /** Allocates or frees a random block, calls times over, then frees what's left.
+        \param allocator the SharedHeapList, or a Cache of it
+        \param calls the number of calls to make
+        \param seed the seed for the thread's generator
+        \param failures incremented for each allocation that fails
+    */
+    template<typename Allocator> void churn(Allocator &allocator, size_t calls, uint32_t seed,
+                                            size_t &failures) {
+        std::vector<Block> blocks(SLOTS, Block{nullptr, 0});
+        uint32_t state = seed;
+        for(size_t i = 0; i < calls; ++i) {
+            Block &block = blocks[next(state) % SLOTS];
+            if(block.memory) {
+                allocator.deallocate(block.memory, block.size);
+                block.memory = nullptr;
+            } else {
+                uint32_t r = next(state);
+                // mostly small, as most allocations are, with the odd one too large to cache
+                block.size = r % 16 ? 1 + r / 16 % SharedHeapList::LARGEST : 1 + r / 16 % 4096;
+                block.memory = allocator.allocate(block.size);
+                if(block.memory)
+                    block.memory[0] = block.memory[block.size - 1] = 1;
+                else
+                    ++failures;
+            }
+        }
+        for(Block &block : blocks)
+            if(block.memory)
+                allocator.deallocate(block.memory, block.size);
+    }
+
+    /** Runs threads that churn the heap.
+        \returns the calls per second, in total */
+    double run(SharedHeapList &shared, unsigned threads, bool cached, size_t calls,
+               size_t &failures, uint64_t &hits, uint64_t &misses) {
+        std::vector<std::thread> workers;
+        std::vector<size_t> failed(threads, 0);
+        std::vector<uint64_t> hit(threads, 0), missed(threads, 0);
+        auto start = std::chrono::steady_clock::now();
+        for(unsigned t = 0; t < threads; ++t)
+            workers.push_back(std::thread([&, t]() {
+                if(cached) {
+                    SharedHeapList::Cache cache(&shared);
+                    churn(cache, calls, 2463534242u + t, failed[t]);
+                    hit[t] = cache.hit_count();
+                    missed[t] = cache.miss_count();
+                } else {
+                    churn(shared, calls, 2463534242u + t, failed[t]);
+                }
+            }));
+        for(std::thread &worker : workers)
+            worker.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for(unsigned t = 0; t < threads; ++t) {
+            failures += failed[t];
+            hits += hit[t];
+            misses += missed[t];
+        }
+        return threads * calls / seconds;
+    }
+
+    int usage(void) {
+        fprintf(stderr, "usage: scaling [-t threads] [-n calls per thread] [-m heap size in MiB]\n");
+        return 2;
+    }
+}
+
+int main(int argc, char **argv) {
+    unsigned most = std::thread::hardware_concurrency();
+    size_t calls = 1000000, megabytes = 64;
+    for(int arg = 1; arg < argc; arg += 2) {
+        if(arg + 1 == argc)
+            return usage();
+        unsigned long value = strtoul(argv[arg + 1], nullptr, 0);
+        if(!value)
+            return usage();
+        if(!strcmp(argv[arg], "-t"))
+            most = value;
+        else if(!strcmp(argv[arg], "-n"))
+            calls = value;
+        else if(!strcmp(argv[arg], "-m"))
+            megabytes = value;
+        else
+            return usage();
+    }
+    if(!most)
+        most = 1;
+
+    size_t size = megabytes << 20;
+    char *memory = static_cast<char *>(aligned_alloc(4096, size));
+    memset(memory, 0, size);
+    HeapList heaps;
+    heaps.add(Heap::create(size, Heap::Attributes(Heap::MEMF_PUBLIC | Heap::MEMF_FAST), 0, memory,
+                           "scaling"));
+    SharedHeapList shared(&heaps);
+    const size_t free = shared.available();
+
+    printf("threads    locked calls/s    cached calls/s   speedup  cache hits\n");
+    bool leaked = false;
+    for(unsigned threads = 1; ; threads = threads * 2 < most ? threads * 2 : most) {
+        size_t failures = 0;
+        uint64_t hits = 0, misses = 0;
+        double locked = run(shared, threads, false, calls, failures, hits, misses);
+        double cached = run(shared, threads, true, calls, failures, hits, misses);
+        shared.drain();
+        printf("%7u %17.0f %17.0f %8.2fx %10.1f%%\n", threads, locked, cached, cached / locked,
+               hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+        if(failures)
+            printf("        %zu allocations failed\n", failures);
+        if(shared.available() != free) {
+            printf("        %zu bytes weren't given back\n", free - shared.available());
+            leaked = true;
+        }
+        if(threads == most)
+            break;
+    }
+    return leaked;
+}
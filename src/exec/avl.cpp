@@ -0,0 +1,311 @@
+// -*- mode: c++ -*-
+/**
+   AVL trees (implementation)
+   \file
+*/
+
+/**
+   \defgroup exec_avl exec.library AVL trees
+
+   An AVL tree is a binary search tree which keeps itself balanced, in that the heights of the two
+   subtrees of every node differ by at most one. Lookups, insertions and removals are therefore all
+   O(log N), which makes them a good fit for things that would otherwise be a long sorted List.
+
+   AmigaOS V45 provided these as AVL_AddNode(), AVL_RemNodeByAddress(), AVL_FindNode() and friends,
+   with the comparison done by caller-provided functions. AVLNode provides the same operations as
+   static methods, and is also used internally, for instance to index the free Chunks of a Heap by
+   address.
+*/
+
+#include <exec/avl.hpp>
+
+using namespace exec;
+
+/** Rotates a subtree, so that the child of its root on one side becomes the new root of the
+    subtree. Balance factors are left for the caller to fix.
+    \param root the root of the whole tree
+    \param node the root of the subtree
+    \param dir the side that \a node moves down to: 0 (left) or 1 (right)
+    \returns the new root of the subtree
+*/
+AVLNode *AVLNode::rotate(AVLNode **root, AVLNode *node, int dir) {
+    AVLNode *child = node->link[!dir];
+    AVLNode *parent = node->parent;
+
+    node->link[!dir] = child->link[dir];
+    if(node->link[!dir])
+        node->link[!dir]->parent = node;
+    child->link[dir] = node;
+    node->parent = child;
+
+    child->parent = parent;
+    *(parent ? &parent->link[parent->link[1] == node] : root) = child;
+    return child;
+}
+
+/** Restores the balance of a subtree whose root has a balance factor of -2 or +2.
+    \param root the root of the whole tree
+    \param node the root of the unbalanced subtree
+    \returns the new root of the subtree, which has a balance factor of zero if and only if the
+    subtree is now shorter than it was before it became unbalanced
+*/
+AVLNode *AVLNode::rebalance(AVLNode **root, AVLNode *node) {
+    int heavy = node->balance > 0;  // the side that's too tall
+    int32_t sign = heavy ? 1 : -1;
+    AVLNode *child = node->link[heavy];
+
+    if(child->balance == -sign) {
+        // the child leans the other way, so its inner child needs to come up two levels
+        AVLNode *grandchild = child->link[!heavy];
+        rotate(root, child, heavy);
+        rotate(root, node, !heavy);
+        node->balance = grandchild->balance == sign ? -sign : 0;
+        child->balance = grandchild->balance == -sign ? sign : 0;
+        grandchild->balance = 0;
+        return grandchild;
+    }
+
+    rotate(root, node, !heavy);
+    if(child->balance == 0) {
+        // this only happens on removal, and the subtree stays the same height
+        node->balance = sign;
+        child->balance = -sign;
+    } else {
+        node->balance = child->balance = 0;
+    }
+    return child;
+}
+
+/** Walks up the tree after a subtree has become shorter, rebalancing as necessary.
+    \param root the root of the whole tree
+    \param node the node whose subtree became shorter, or nullptr if it was the whole tree
+    \param dir the side of \a node that became shorter
+*/
+void AVLNode::shrunk(AVLNode **root, AVLNode *node, int dir) {
+    while(node) {
+        AVLNode *parent = node->parent;
+        int pdir = parent && parent->link[1] == node;
+        node->balance += dir ? -1 : 1;
+        // if it used to be balanced, it's now lopsided but no shorter
+        if(node->balance == 1 || node->balance == -1)
+            return;
+        if(node->balance && rebalance(root, node)->balance)
+            return;
+        node = parent;
+        dir = pdir;
+    }
+}
+
+/** Adds a node to a tree [AmigaOS AVL_AddNode()].
+    \param root the root of the tree, which is updated as necessary
+    \param node the node to add
+    \param compare the function used to order nodes
+    \returns nullptr if the node was added, or an existing node with the same key, in which case
+    the tree is unchanged
+*/
+AVLNode *AVLNode::add(AVLNode **root, AVLNode *node, NodeComparator compare) {
+    AVLNode *parent = nullptr;
+    int dir = 0;
+    for(AVLNode *n = *root; n; n = n->link[dir]) {
+        int32_t c = compare(node, n);
+        if(!c)
+            return n;
+        parent = n;
+        dir = c > 0;
+    }
+
+    node->link[0] = node->link[1] = nullptr;
+    node->parent = parent;
+    node->balance = 0;
+    *(parent ? &parent->link[dir] : root) = node;
+
+    // walk back up the tree while the subtrees are getting taller
+    for(AVLNode *n = node; (parent = n->parent); n = parent) {
+        parent->balance += parent->link[1] == n ? 1 : -1;
+        if(!parent->balance)
+            break;
+        if(parent->balance == 2 || parent->balance == -2) {
+            // after an insertion, rebalancing always restores the subtree's previous height
+            rebalance(root, parent);
+            break;
+        }
+    }
+    return nullptr;
+}
+
+/** Removes a node from a tree [AmigaOS AVL_RemNodeByAddress()].
+    \param root the root of the tree, which is updated as necessary
+    \param node the node to remove, which must be in the tree
+    \returns the removed node
+*/
+AVLNode *AVLNode::remove(AVLNode **root, AVLNode *node) {
+    AVLNode *parent = node->parent;
+    int pdir = parent && parent->link[1] == node;
+    AVLNode **pnode = parent ? &parent->link[pdir] : root;
+    AVLNode *start;             // where the tree became shorter
+    int dir;                    // and on which side
+
+    if(node->link[0] && node->link[1]) {
+        // a node with two children is replaced by its successor, which has no left child
+        AVLNode *successor = first(node->link[1]);
+        if(successor->parent == node) {
+            start = successor;
+            dir = 1;
+        } else {
+            start = successor->parent;
+            dir = 0;
+            start->link[0] = successor->link[1];
+            if(start->link[0])
+                start->link[0]->parent = start;
+            successor->link[1] = node->link[1];
+            successor->link[1]->parent = successor;
+        }
+        successor->link[0] = node->link[0];
+        successor->link[0]->parent = successor;
+        successor->parent = parent;
+        successor->balance = node->balance;
+        *pnode = successor;
+    } else {
+        // otherwise its only child, if any, takes its place
+        AVLNode *child = node->link[node->link[0] == nullptr];
+        if(child)
+            child->parent = parent;
+        *pnode = child;
+        start = parent;
+        dir = pdir;
+    }
+
+    shrunk(root, start, dir);
+    return node;
+}
+
+/** Finds a node by key [AmigaOS AVL_FindNode()].
+    \param root the root of the tree
+    \param key the key to look for
+    \param compare the function used to compare nodes against the key
+    \returns the node with that key, or nullptr if there is none
+*/
+AVLNode *AVLNode::find(const AVLNode *root, const void *key, KeyComparator compare) {
+    while(root) {
+        int32_t c = compare(root, key);
+        if(!c)
+            return const_cast<AVLNode *>(root);
+        root = root->link[c < 0];
+    }
+    return nullptr;
+}
+
+/** Finds the node with the highest key at or before a given key [AmigaOS AVL_FindPrevNodeByKey()].
+    \param root the root of the tree
+    \param key the key to look for
+    \param compare the function used to compare nodes against the key
+    \returns the node, or nullptr if every node sorts after the key
+*/
+AVLNode *AVLNode::find_prev(const AVLNode *root, const void *key, KeyComparator compare) {
+    const AVLNode *found = nullptr;
+    while(root) {
+        int32_t c = compare(root, key);
+        if(!c)
+            return const_cast<AVLNode *>(root);
+        if(c < 0)
+            found = root;
+        root = root->link[c < 0];
+    }
+    return const_cast<AVLNode *>(found);
+}
+
+/** Finds the node with the lowest key at or after a given key [AmigaOS AVL_FindNextNodeByKey()].
+    \param root the root of the tree
+    \param key the key to look for
+    \param compare the function used to compare nodes against the key
+    \returns the node, or nullptr if every node sorts before the key
+*/
+AVLNode *AVLNode::find_next(const AVLNode *root, const void *key, KeyComparator compare) {
+    const AVLNode *found = nullptr;
+    while(root) {
+        int32_t c = compare(root, key);
+        if(!c)
+            return const_cast<AVLNode *>(root);
+        if(c > 0)
+            found = root;
+        root = root->link[c < 0];
+    }
+    return const_cast<AVLNode *>(found);
+}
+
+/** Finds the lowest node in a tree [AmigaOS AVL_FindFirstNode()].
+    \param root the root of the tree
+    \returns the node, or nullptr if the tree is empty
+*/
+AVLNode *AVLNode::first(const AVLNode *root) {
+    if(root)
+        while(root->link[0])
+            root = root->link[0];
+    return const_cast<AVLNode *>(root);
+}
+
+/** Finds the highest node in a tree [AmigaOS AVL_FindLastNode()].
+    \param root the root of the tree
+    \returns the node, or nullptr if the tree is empty
+*/
+AVLNode *AVLNode::last(const AVLNode *root) {
+    if(root)
+        while(root->link[1])
+            root = root->link[1];
+    return const_cast<AVLNode *>(root);
+}
+
+/** Finds the node before this one [AmigaOS AVL_FindPrevNodeByAddress()].
+    \returns the node, or nullptr if this is the lowest node in the tree
+*/
+AVLNode *AVLNode::prev(void) const {
+    if(link[0])
+        return last(link[0]);
+    const AVLNode *node = this;
+    while(node->parent && node->parent->link[0] == node)
+        node = node->parent;
+    return node->parent;
+}
+
+/** Finds the node after this one [AmigaOS AVL_FindNextNodeByAddress()].
+    \returns the node, or nullptr if this is the highest node in the tree
+*/
+AVLNode *AVLNode::next(void) const {
+    if(link[1])
+        return first(link[1]);
+    const AVLNode *node = this;
+    while(node->parent && node->parent->link[1] == node)
+        node = node->parent;
+    return node->parent;
+}
+
+/** Measures a subtree, checking its links and balance factors on the way.
+    \param node the root of the subtree
+    \param parent the node that should be the parent of \a node
+    \returns the height of the subtree, or -1 if it is inconsistent
+*/
+int AVLNode::height(const AVLNode *node, const AVLNode *parent) {
+    if(!node)
+        return 0;
+    if(node->parent != parent)
+        return -1;
+    int left = height(node->link[0], node), right = height(node->link[1], node);
+    if(left < 0 || right < 0 || right - left != node->balance
+        || node->balance < -1 || node->balance > 1)
+        return -1;
+    return 1 + (left > right ? left : right);
+}
+
+/** Checks a tree for consistency.
+    \param root the root of the tree
+    \param compare the function used to order nodes
+    \returns true if the tree is correctly linked, balanced and ordered
+*/
+bool AVLNode::is_sane(const AVLNode *root, NodeComparator compare) {
+    if(height(root, nullptr) < 0)
+        return false;
+    for(const AVLNode *node = first(root), *next; node && (next = node->next()); node = next)
+        if(compare(node, next) >= 0)
+            return false;
+    return true;
+}
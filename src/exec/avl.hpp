@@ -0,0 +1,48 @@
+// -*- mode: c++ -*-
+/**
+   AVL trees (headers)
+   \file
+*/
+
+#ifndef EXEC_AVL_HPP
+#define EXEC_AVL_HPP
+
+#include <exec/types.hpp>
+
+/** a node in a self-balancing binary tree [AmigaOS struct %AVLNode] \ingroup exec_avl
+
+    Nodes are embedded in the objects that they sort, as with MinNode. The tree itself is nothing more
+    than a pointer to its root node, which is nullptr for an empty tree.
+*/
+class exec::AVLNode {
+    AVLNode *link[2];           //!< left (lower) and right (higher) subtrees
+    AVLNode *parent;            //!< parent node, or nullptr if this is the root
+    int32_t balance;            //!< height of the right subtree less that of the left one
+    // This structure is part of the AmigaOS ABI and may not be extended.
+
+    static AVLNode *rotate(AVLNode **, AVLNode *, int);
+    static AVLNode *rebalance(AVLNode **, AVLNode *);
+    static void shrunk(AVLNode **, AVLNode *, int);
+    static int height(const AVLNode *, const AVLNode *);
+
+public:
+    /** node comparison function: negative, zero or positive as the first node sorts before, with or
+        after the second [AmigaOS AVLNODECOMP] */
+    typedef int32_t (*NodeComparator)(const AVLNode *, const AVLNode *);
+    /** key comparison function: negative, zero or positive as the node sorts before, with or after
+        the key [AmigaOS AVLKEYCOMP] */
+    typedef int32_t (*KeyComparator)(const AVLNode *, const void *);
+
+    static AVLNode *add(AVLNode **, AVLNode *, NodeComparator) __attribute__((nonnull));
+    static AVLNode *remove(AVLNode **, AVLNode *) __attribute__((nonnull));
+    static AVLNode *find(const AVLNode *, const void *, KeyComparator);
+    static AVLNode *find_prev(const AVLNode *, const void *, KeyComparator);
+    static AVLNode *find_next(const AVLNode *, const void *, KeyComparator);
+    static AVLNode *first(const AVLNode *);
+    static AVLNode *last(const AVLNode *);
+    AVLNode *prev(void) const;
+    AVLNode *next(void) const;
+    static bool is_sane(const AVLNode *, NodeComparator);
+};
+
+#endif
@@ -18,6 +18,7 @@
 #include <exec/debugger.hpp>
 #include <hw/amiga.hpp>
 #include <exec/libc.hpp>
+#include <exec/memory.hpp>
 
 using namespace exec;
 
@@ -279,3 +280,58 @@ void Formatter::Raw::output(const char *start, const char *end) {
         asm ("jsr (%0)" : : "a"(code), "d"(in_d0), "a"(in_a3) : "%d1", "%a0", "%a1", "%cc" );
     }
 }
+
+void Formatter::Serial::output(const char *start, const char *end) {
+    while(start != end)
+        Debugger::putc(*start++);
+}
+
+/** Prints the fragmentation statistics of each heap, and a histogram of its free Chunk sizes
+    [Openkick DumpHeaps()].
+    \param heaps the heaps to describe
+    \param out where to print them
+*/
+void Debugger::show_heaps(const HeapList *heaps, Formatter *out) {
+    Heap::Statistics stats;
+    for(HeapList::const_iterator i = heaps->begin(), e = heaps->end(); i != e; ++i) {
+        const Heap *heap = *i;
+        heap->lock();
+        heap->statistics(&stats);
+        heap->unlock();
+        const struct {
+            const char *name;
+            uint32_t free, chunks, largest, percent, tenths;
+        } summary = {
+            heap->name, stats.free, stats.chunks, stats.largest,
+            stats.fragmentation / 10u, stats.fragmentation % 10u
+        };
+        out->format("%s: %lu bytes free in %lu chunks, largest %lu, fragmentation %lu.%lu%%\n",
+                   reinterpret_cast<const char *>(&summary));
+        for(uint32_t n = 0; n < Heap::Statistics::BUCKETS; ++n)
+            if(stats.histogram[n]) {
+                const uint32_t bucket[] = {1u << n, stats.histogram[n]};
+                out->format("  %10lu+: %lu\n", reinterpret_cast<const char *>(bucket));
+            }
+    }
+}
+
+/** Prints the call sites that an AllocProfile has sampled [Openkick DumpAllocProfile()].
+    \param profile the profile
+    \param out where to print it
+*/
+void Debugger::show_alloc_profile(const AllocProfile *profile, Formatter *out) {
+    if(!profile->sites) {
+        out->format("allocation profiling is off\n", nullptr);
+        return;
+    }
+    const uint32_t header[] = {profile->period, profile->dropped};
+    out->format(profile->mode == AllocProfile::SAMPLE_BYTES
+                ? "one sample every %lu bytes, %lu dropped\n caller      allocs    frees      bytes\n"
+                : "one sample every %lu calls, %lu dropped\n caller      allocs    frees      bytes\n",
+                reinterpret_cast<const char *>(header));
+    for(uint32_t n = 0; n < AllocProfile::SITES; ++n) {
+        const AllocProfile::Site *site = &profile->sites[n];
+        if(site->caller)
+            out->format("%p %8lu %8lu %10lu\n", reinterpret_cast<const char *>(site));
+    }
+}
@@ -39,6 +39,8 @@ public:
     static void putc(char c);
     static char getc(void);
     static int try_getc(void);
+    static void show_heaps [[gnu::nonnull]] (const HeapList *, Formatter *);
+    static void show_alloc_profile [[gnu::nonnull]] (const AllocProfile *, Formatter *);
 
 };
 
@@ -48,6 +50,7 @@ protected:
     virtual void output(const char *, const char *) = 0;
 public:
     class Raw;
+    class Serial;
     const char *format(const char *, const char *);
 };
 
@@ -61,4 +64,10 @@ public:
         : code(code_), data(data_) {}
 };
 
+/** a Formatter that writes to the debugger's serial port */
+class exec::Formatter::Serial : public Formatter {
+protected:
+    void output(const char *, const char *);
+};
+
 #endif
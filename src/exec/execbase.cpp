@@ -471,7 +471,7 @@ char *ExecBase::startup(void) {
     // now find somewhere to drop supervisor stack
     size_t supervisor_stack_size = 6 * 1024;
     char *supervisor_stack =
-        heaplist.allocate(supervisor_stack_size, Heap::MEMF_PUBLIC, Heap::MEMF_REVERSE);
+        heaplist.allocate_early(supervisor_stack_size, Heap::MEMF_PUBLIC, Heap::MEMF_REVERSE);
     if(!supervisor_stack) asm(".word 0x4afc");
 
     /// \todo deal with custom allocator
@@ -501,9 +501,9 @@ char *ExecBase::startup(void) {
     // Task *exec_task = new ( me->entries[0].addr ) Task("exec.library");
     // char *exec_stack = me->entries[1].addr;
 
-    // FIXME: new adds size block and thus wastes 8 bytes.
     Task *exec_task = new Task("exec.library");
-    char *exec_stack = new char[exec_stack_size];
+    // the stack is too big for the size classes, and new would put a size header in front of it
+    char *exec_stack = execbase->AllocMem(exec_stack_size, Heap::MEMF_PUBLIC);
     execbase->task_ready.add(exec_task);
     execbase->this_task = exec_task;
     exec_task->stack_bottom = exec_stack;
@@ -562,6 +562,7 @@ void ExecBase::startup2(void) {
     */
 
     while(1) {
+        execbase->idle();
         //ciaa->pra ^= 2;
         custom->color(0, 0x00f);
         for(int n=0; n<(1<<5); ++n) {asm("");};
@@ -570,6 +571,29 @@ void ExecBase::startup2(void) {
     }
 }
 
+/** Does background work when there is nothing else to do: for now, zeroing some free memory so
+    that MEMF_CLEAR allocations don't have to.
+    \todo call this from the dispatcher when there are no tasks to run
+*/
+void ExecBase::idle(void) {
+    ++idle_count;
+    heap_list.scrub(1024);
+}
+
+/** Waits for another task to let go of a bit lock, such as a Heap's. That task may have been
+    switched out part way through, so any Forbid() is broken while waiting, as Wait() would break
+    it, and restored afterwards.
+    \todo sleep on a signal rather than spinning, once Wait() works
+    \param flag the lock, whose bit 0 is set while it is held
+*/
+void ExecBase::wait_for_lock(volatile uint8_t *flag) {
+    int8_t nesting = tdnestcnt;
+    tdnestcnt = -1;
+    while(*flag & 1)
+        ;
+    tdnestcnt = nesting;
+}
+
 ExecBase::ExecBase(
     char *sys_stack_upper, char *sys_stack_lower,
     char *chipmem_top, char *slowmem_top,
@@ -581,6 +605,8 @@ ExecBase::ExecBase(
     , tdnestcnt(0)
     , attn_flags(probe_cpu())
     , heap_list(new_heap_list)
+    , memory_state(&heap_list, sizeof(Task), sizeof(Message), sizeof(IORequest),
+                   sizeof(ResidentArray::BuilderNode))
 {
     // add it to the library list
     library_list.add_library(this);
@@ -618,5 +644,40 @@ void ExecBase::enable(void) {
 }
 
 void *Task::operator new(size_t size) {
-    return execbase->AllocMem(size, Heap::MEMF_PUBLIC);
+    execbase->forbid();
+    char *task = execbase->memory()->task_cache.allocate(size);
+    execbase->Permit();
+    return task;
+}
+
+void Task::operator delete(void *task, size_t size) {
+    execbase->forbid();
+    execbase->memory()->task_cache.deallocate(static_cast<char *>(task), size);
+    execbase->Permit();
+}
+
+void *Message::operator new(size_t size) {
+    execbase->forbid();
+    char *message = execbase->memory()->message_cache.allocate(size);
+    execbase->Permit();
+    return message;
+}
+
+void Message::operator delete(void *message, size_t size) {
+    execbase->forbid();
+    execbase->memory()->message_cache.deallocate(static_cast<char *>(message), size);
+    execbase->Permit();
+}
+
+void *IORequest::operator new(size_t size) {
+    execbase->forbid();
+    char *iorequest = execbase->memory()->iorequest_cache.allocate(size);
+    execbase->Permit();
+    return iorequest;
+}
+
+void IORequest::operator delete(void *iorequest, size_t size) {
+    execbase->forbid();
+    execbase->memory()->iorequest_cache.deallocate(static_cast<char *>(iorequest), size);
+    execbase->Permit();
 }
@@ -135,6 +135,11 @@ class exec::ExecBase : private Library {
     void *kick_tag_ptr;
     void *kick_checksum;          // not really a pointer
 
+    // Everything above is the V33 ExecBase. Everything below is private to Openkick, and nothing
+    // outside exec.library should rely on it.
+
+    MemoryState memory_state;     //!< the allocators, besides #heap_list
+
 private:
     ExecBase *open(void) {
         ++open_count;
@@ -147,6 +152,9 @@ private:
 public:
     ExecBase(char *, char *, char *, char *, HeapList *);
 
+    /** \returns the allocators' state, for the operator new and delete that they back */
+    MemoryState *memory(void) { return &memory_state; }
+
     static char *startup(void) asm("_init");
     static void startup2(void) asm("_init2") __attribute__((noreturn));
     static CPUType probe_cpu(void) asm("exec$probe_cpu");
@@ -157,6 +165,8 @@ public:
     void permit(void);
     void disable(void);
     void enable(void);
+    void idle(void);
+    void wait_for_lock(volatile uint8_t *);
 
 #include <gen/exec.cdec.inc>
 };
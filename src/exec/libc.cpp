@@ -52,6 +52,15 @@ void *bzero(void *s, size_t n) {
     return s;
 }
 
+// \todo write optimised version
+void *memcpy(void *dest, const void *src, size_t n) {
+    unsigned char *ud = static_cast<unsigned char *>(dest);
+    const unsigned char *us = static_cast<const unsigned char *>(src);
+    while (n-- != 0)
+        *ud++ = *us++;
+    return dest;
+}
+
 /* FIXME: this algorithm is incomplete and untested
 
 uint32_t __udivsi3(uint32_t left, uint32_t right) {
@@ -8,6 +8,7 @@
 
 void *memset(void *, int, size_t) __attribute__((nonnull));
 void *bzero(void *, size_t) __attribute__((nonnull));
+void *memcpy(void *, const void *, size_t) __attribute__((nonnull));
 
 int strcmp(const char *, const char *) __attribute__((nonnull));
 inline int strcmp(const char *s1, const char *s2) {
@@ -297,6 +297,19 @@ ResidentArray::BuilderNode::BuilderNode(
       resident(resident_)
 {}
 
+void *ResidentArray::BuilderNode::operator new(size_t size) {
+    execbase->forbid();
+    char *node = execbase->memory()->builder_cache.allocate(size);
+    execbase->Permit();
+    return node;
+}
+
+void ResidentArray::BuilderNode::operator delete(void *node, size_t size) {
+    execbase->forbid();
+    execbase->memory()->builder_cache.deallocate(static_cast<char *>(node), size);
+    execbase->Permit();
+}
+
 void ResidentArray::BuilderList::add(const Resident *resident) {
     // now we try and stuff it into the list. We first look to see if it
     // is already present.
@@ -509,10 +522,11 @@ void LibraryList::add_library(Library *library) {
 //return heap->allocate(size);
 //}
 
+// This is used to make ExecBase itself, so mustn't need ExecBase to allocate.
 void *Library::operator new(size_t size, HeapList *heaplist, const PackedFunctions *fa) {
     size_t vector_size = fa->count();
     size_t vector_alloc = (vector_size + 3) & ~3;
-    char * buf = heaplist->allocate(vector_alloc + size);
+    char * buf = heaplist->allocate_early(vector_alloc + size);
     Library * library = reinterpret_cast<Library *>(buf + vector_alloc);
     fa->unpack(library);
     return library;
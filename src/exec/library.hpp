@@ -110,10 +110,10 @@ struct exec::Resident {
 /** [anonymous AmigaOS structure] \ingroup exec_library */
 class exec::ResidentArray {
     const Resident *entries[0];
-    class BuilderNode;
     void *operator new(size_t);
     void operator delete(void *);
 public:
+    class BuilderNode;
     class BuilderList;
     const Resident *find_name(const char *) const;
     void initialise(Resident::Flags, uint8_t) const;
@@ -123,6 +123,8 @@ class exec::ResidentArray::BuilderNode : public Node {
 public:
     const Resident *resident;
     BuilderNode(uint8_t priority_, const char *name_, const Resident *resident_);
+    void *operator new(size_t);
+    void operator delete(void *, size_t);
 };
 
 class exec::ResidentArray::BuilderList : public ListOf<BuilderNode> {
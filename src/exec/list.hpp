@@ -491,7 +491,9 @@ public:
         \param node the node to return
         \returns the removed node (i.e. \a node itself)
      */
-    static node_t *remove(MinNode *node) __attribute__((nonnull)) { return List::remove(node); }
+    static node_t *remove(MinNode *node) __attribute__((nonnull)) {
+        return static_cast<node_t *>(List::remove(node));
+    }
 
     /** inserts a node after another node
         \param existing the existing node that we will insert after
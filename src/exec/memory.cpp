@@ -38,14 +38,45 @@
    implementations of new/delete need to squirrel away the space needed for the size *without*
    breaking the ABI.
 
+   Walking the Chunk list gets slower as a Heap fragments, so the large heaps made by Heap::create()
+   also carry a Heap::Index, which is a size-class index of their free Chunks that is kept in memory
+   of its own alongside the Heap, and an AVL tree of them by address. The Chunk list is maintained as
+   usual, so code that walks it is none the wiser, but allocation, deallocation and AllocAbs() no
+   longer need to walk it. An indexed Heap can also be switched to next fit with SetHeapPolicy(),
+   which keeps a roving pointer in the Index so that each search resumes where the last one ended.
+
+   An Index also tracks a range of free memory that is known to be zero, which is built up a little
+   at a time by scrub() while the system is idle. MEMF_CLEAR allocations that are served from that
+   range don't need clearing again.
+
+   AllocMem() doesn't Forbid() for the whole call. Each Heap is locked only while it is searched or
+   changed, so choosing a Heap and clearing MEMF_CLEAR memory are done with task switching enabled.
+   A Heap with an Index is locked with a bit in the Index rather than with Forbid(), so tasks using
+   other heaps aren't held up either.
+
+   Large allocations, of at least the threshold set with SetLargeThreshold(), are served from whole
+   pages at the bottom of a Heap by LargeObjects instead. Their extents are tracked in a map of their
+   own, so freeing one doesn't leave a hole in the Chunk list for small allocations to fill.
+   SetLargeThreshold() returns the previous threshold, or 1, which can never be one, if the new
+   threshold is smaller than a page.
+
    \todo split the Heap::Flags into attributes and options so that we can use a Flags type for
    memory attributes.
 
 */
 
 #include <exec/memory.hpp>
+#include <exec/avl.hpp>
 #include <exec/new.hpp>
-#include <exec/libc.hpp> // for bzero
+#include <exec/libc.hpp> // for bzero, memcpy
+#ifdef HOSTED_TEST
+#include <exec/library.hpp>
+#include <exec/message.hpp>
+#include <exec/todo.hpp> // for Interrupt
+#else
+#include <exec/execbase.hpp> // for Interrupt, and ExecBase for the low-memory handlers
+#include <hw/amiga.hpp> // for the CIA B time-of-day counter
+#endif
 
 using namespace exec;
 
@@ -62,6 +93,7 @@ class exec::Heap::Chunk {
     */
     Chunk(Heap::Chunk *next_, size_t size_) : next(next_), size(size_) {};
     friend class Heap;
+    friend class Heap::Index;
     friend class HeapList;
 
     //static Chunk ** find_first(Chunk **, size_t);
@@ -73,6 +105,786 @@ class exec::Heap::Chunk {
 //     return find_first(&(*pchunk)->next, size);
 // }
 
+// -------------------- Heap::Index --------------------
+
+/** \returns the smallest power of two that is at least \a size, starting the search at \a power */
+static constexpr size_t power_of_two_at_least(size_t size, size_t power = 8) {
+    return power >= size ? power : power_of_two_at_least(size, power * 2);
+}
+
+/** \returns the base-2 logarithm of \a power, which must be a power of two */
+static constexpr unsigned log2_of(size_t power) {
+    return power > 1 ? 1 + log2_of(power / 2) : 0;
+}
+
+/** \returns the bit number of the most significant set bit in \a x, which must be nonzero */
+static inline unsigned highest_bit(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+/** \returns the bit number of the least significant set bit in \a x, which must be nonzero */
+static inline unsigned lowest_bit(uint32_t x) {
+    return __builtin_ctz(x);
+}
+
+/** Sets bit 0 of a lock byte, in a single instruction so that no other task can come between the
+    test and the set. That is bset rather than tas, whose read-modify-write cycle Chip RAM doesn't
+    support.
+    \param flag the lock byte
+    \returns true if the bit was already set
+*/
+static inline bool test_and_set(volatile uint8_t *flag) {
+#ifdef HOSTED_TEST
+    return __atomic_test_and_set(flag, __ATOMIC_ACQUIRE);
+#else
+    uint8_t was_set;
+    asm volatile("bset #0,%1\n\tsne %0" : "=d"(was_set), "+m"(*flag) : : "cc", "memory");
+    return was_set;
+#endif
+}
+
+/** Adds to a total that tasks holding different locks may change at once, in a single instruction.
+    \param total the total
+    \param delta how much to add
+*/
+static inline void add_atomically(uint32_t *total, int32_t delta) {
+#ifdef HOSTED_TEST
+    __atomic_add_fetch(total, delta, __ATOMIC_RELAXED);
+#else
+    asm volatile("add.l %1,%0" : "+m"(*total) : "d"(delta) : "cc");
+#endif
+}
+
+/** the size-class index of a Heap \ingroup exec_memory
+
+    This is a two-level segregated fit ("TLSF") index of the free Chunks in a Heap. Chunk sizes are
+    split into first-level classes by power of two, and each of those is split again into SL_COUNT
+    second-level classes of equal width. Each class has a doubly-linked list of its free Chunks, and
+    a pair of bitmaps records which classes are not empty, so a Chunk that is large enough to satisfy
+    an allocation can be found with a couple of bit scans rather than a walk of the Chunk list.
+
+    A Heap is part of the AmigaOS ABI and cannot grow a pointer to its Index, so Heap::create()
+    places the Index immediately after the Heap, with a pointer back to it, and starts the managed
+    memory right after that. Heap::index() checks both before trusting the Index. Heaps that were
+    not made that way, and heaps smaller than MINIMUM_SIZE, simply don't get one.
+
+    The free Chunks are also kept in an AVLNode tree sorted by address. That finds the neighbours of
+    memory being freed or allocated at a specific address in O(log N), and doubles as the backward
+    link that the singly-linked Chunk list lacks.
+
+    The per-Chunk bookkeeping (Index::Links) lives in the free memory of the Chunk itself. Every free
+    Chunk in an indexed Heap therefore needs to be large enough to hold it, and so indexed heaps
+    deal in multiples of GRANULE bytes, aligned to GRANULE bytes, rather than the usual eight.
+
+    Small blocks tend to be freed and allocated again straight away at the same size, so blocks of
+    up to QUICK_CLASSES granules aren't merged back into the Chunks when they are freed, but pushed
+    onto a quick-list for their size, which allocate() serves first. A quick-list is merged when it
+    grows past QUICK_LIMIT blocks, and all of them are when an allocation would otherwise fail or
+    something needs to see the Chunks as they really are. Their memory counts as free all along.
+*/
+class exec::Heap::Index {
+public:
+    /// bookkeeping kept in the body of every free Chunk of an indexed Heap
+    class Links {
+    public:
+        AVLNode node;           //!< node in the address-ordered tree of free Chunks
+        Chunk *class_next;      //!< next Chunk in the same size class, or nullptr if it's the last
+        Chunk *class_prev;      //!< previous Chunk in the same size class, or nullptr if it's the first
+    };
+
+    enum : uint32_t {
+        /** allocation granularity: the smallest power of two that holds a Chunk and its Links */
+        GRANULE = power_of_two_at_least(sizeof(Chunk) + sizeof(Links)),
+        GRANULE_SHIFT = log2_of(GRANULE), //!< log2(GRANULE)
+        SL_SHIFT = 3,                     //!< log2(SL_COUNT)
+        SL_COUNT = 1 << SL_SHIFT,         //!< number of second-level classes per first-level class
+        FL_COUNT = 32 - GRANULE_SHIFT,    //!< number of first-level classes
+        MINIMUM_SIZE = 32 << 10,          //!< the smallest Heap that Heap::create() will index
+        QUICK_CLASSES = 2,                //!< freed blocks of up to this many granules are deferred
+        QUICK_LIMIT = 16,                 //!< the most blocks a quick-list holds before it's merged
+    };
+
+private:
+    friend class Heap;
+    friend class HeapTable;
+    Heap *heap;                         //!< the Heap that this Index belongs to
+    AVLNode *root;                      //!< the tree of free Chunks, by address
+    Chunk *last;                        //!< the free Chunk with the highest address, or nullptr
+    Chunk *rover;                       //!< where POLICY_NEXT_FIT resumes its search, or nullptr
+    char *zero_lower;                   //!< start of the free memory known to be zero
+    char *zero_upper;                   //!< one past the end of the free memory known to be zero
+    uint32_t *tally;                    //!< a HeapTable total that tracks the free memory, or nullptr
+    Policy policy;                      //!< how allocate() chooses a Chunk
+    bool last_zero;                     //!< whether the last allocation was known to be zero
+    volatile uint8_t locked;            //!< bit 0 is set while a task has the Heap locked
+    mutable uint32_t largest;           //!< at least the size of the largest free Chunk
+    mutable bool largest_exact;         //!< whether \c largest is exactly that size
+    uint32_t fl_bitmap;                 //!< bit n is set if first-level class n is not empty
+    uint8_t sl_bitmap[FL_COUNT];        //!< bit n of entry f is set if class [f][n] is not empty
+    Chunk *classes[FL_COUNT][SL_COUNT]; //!< the lists of free Chunks, by size class
+    Chunk *quick[QUICK_CLASSES];        //!< recently freed small blocks, by size, most recent first
+    uint8_t quick_count[QUICK_CLASSES]; //!< the number of blocks on each quick-list
+
+    /** get the Links of a Chunk, which immediately follow its header
+        \param chunk the Chunk \returns its Links */
+    static Links *links(Chunk *chunk) { return reinterpret_cast<Links *>(chunk + 1); }
+    /** get the Chunk that a tree node belongs to
+        \param node the node, or nullptr \returns its Chunk, or nullptr */
+    static Chunk *chunk_of(const AVLNode *node) {
+        return node ? reinterpret_cast<Chunk *>(const_cast<AVLNode *>(node)) - 1 : nullptr;
+    }
+    static int32_t compare(const AVLNode *, const AVLNode *);
+    static int32_t compare_key(const AVLNode *, const void *);
+    Chunk *below(const char *) const;
+    bool overlaps(const char *, const char *) const;
+    static void mapping(uint32_t, unsigned &, unsigned &);
+    Chunk *search(unsigned, unsigned) const;
+    Chunk *find(uint32_t) const;
+    void insert(Chunk *);
+    void remove(Chunk *);
+    void chain(Chunk *, Chunk *);
+    void unchain(Chunk *);
+    char *carve(Chunk *, uint32_t);
+    char *allocate_next(uint32_t);
+    bool merge(char *, char *);
+    void flush_class(unsigned);
+    void dirty(char *, char *, char *);
+    /** adjusts the free memory of the Heap, and the HeapTable total that tracks it, which other
+        Heaps of the same attributes share
+        \param delta the change in free memory, in bytes */
+    void account(int32_t delta) {
+        heap->free += delta;
+        if(tally)
+            add_atomically(tally, delta);
+    }
+
+public:
+    Index(Heap *);
+    /** rounds a size up to the granularity of an indexed heap
+        \param size the size, in bytes \returns the rounded size */
+    static uint32_t round(size_t size) { return (size + GRANULE - 1) & ~(GRANULE - 1); }
+    /** rounds an address down to the granularity of an indexed heap
+        \param p the address \returns the rounded address */
+    static char *align_down(char *p) {
+        return reinterpret_cast<char *>(reinterpret_cast<address_t>(p) & ~address_t(GRANULE - 1));
+    }
+    /** rounds an address up to the granularity of an indexed heap
+        \param p the address \returns the rounded address */
+    static char *align_up(char *p) { return align_down(p + GRANULE - 1); }
+    char *allocate(uint32_t);
+    char *allocate_reverse(uint32_t);
+    char *allocate_aligned(uint32_t, uint32_t);
+    size_t allocate_n(uint32_t, size_t, char **);
+    bool allocate_at(char *, char *);
+    void deallocate(char *, char *);
+    bool flush(void);
+    uint32_t find_largest(void) const;
+    size_t scrub(size_t);
+    bool is_sane(void) const;
+};
+
+/** constructor. The Heap's initial Chunk is entered into the new Index.
+    \param heap_ the Heap to index, which must immediately precede the Index in memory
+*/
+Heap::Index::Index(Heap *heap_)
+    : heap(heap_), root(nullptr), last(heap_->first), rover(nullptr), zero_lower(nullptr),
+      zero_upper(nullptr), tally(nullptr), policy(POLICY_GOOD_FIT), last_zero(false), locked(0), largest(0),
+      largest_exact(true), fl_bitmap(0), sl_bitmap(), classes(), quick(), quick_count()
+{
+    if(heap->first) {
+        AVLNode::add(&root, &links(heap->first)->node, compare);
+        insert(heap->first);
+    }
+}
+
+/** Orders tree nodes by the address of their Chunks. */
+int32_t Heap::Index::compare(const AVLNode *left, const AVLNode *right) {
+    return left < right ? -1 : left > right;
+}
+
+/** Orders a tree node against an address. */
+int32_t Heap::Index::compare_key(const AVLNode *node, const void *key) {
+    const void *chunk = chunk_of(node);
+    return chunk < key ? -1 : chunk > key;
+}
+
+/** Finds the free Chunk that would contain an address.
+    \param p the address
+    \returns the last Chunk that starts at or before \a p, or nullptr if there is none
+*/
+Heap::Chunk *Heap::Index::below(const char *p) const {
+    return chunk_of(AVLNode::find_prev(root, p, compare_key));
+}
+
+/** Checks whether memory overlaps any free memory, either a free Chunk or a block on a
+    quick-list.
+    \param bottom the start of the memory
+    \param top one past the end of the memory
+    \returns true if it does
+*/
+bool Heap::Index::overlaps(const char *bottom, const char *top) const {
+    const Chunk *previous = below(bottom);
+    const Chunk *following = previous ? previous->next : heap->first;
+    if((following && reinterpret_cast<const char *>(following) < top)
+        || (previous && reinterpret_cast<const char *>(previous) + previous->size > bottom))
+        return true;
+    // the quick-lists are short, so they can simply be walked
+    for(unsigned q = 0; q < QUICK_CLASSES; ++q)
+        for(const Chunk *block = quick[q]; block; block = block->next)
+            if(reinterpret_cast<const char *>(block) < top
+                && reinterpret_cast<const char *>(block) + block->size > bottom)
+                return true;
+    return false;
+}
+
+/** Determines the size class of a Chunk size.
+    \param size the size, which must be at least GRANULE
+    \param fl receives the first-level class
+    \param sl receives the second-level class
+*/
+void Heap::Index::mapping(uint32_t size, unsigned &fl, unsigned &sl) {
+    unsigned bit = highest_bit(size);
+    // the second-level class is given by the SL_SHIFT bits after the most significant one
+    sl = (size >> (bit - SL_SHIFT)) & (SL_COUNT - 1);
+    fl = bit - GRANULE_SHIFT;
+}
+
+/** Finds the first non-empty size class at or above a given class.
+    \param fl the first-level class to start from
+    \param sl the second-level class to start from
+    \returns the first Chunk in that class, or nullptr if there is none
+*/
+Heap::Chunk *Heap::Index::search(unsigned fl, unsigned sl) const {
+    // first look for a non-empty second-level class in this first-level class...
+    uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+    if(!sl_map) {
+        // ...and failing that, use the first non-empty first-level class above it
+        uint32_t fl_map = fl + 1 < FL_COUNT ? fl_bitmap & (~0u << (fl + 1)) : 0;
+        if(!fl_map)
+            return nullptr;
+        fl = lowest_bit(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    return classes[fl][lowest_bit(sl_map)];
+}
+
+/** Finds a free Chunk large enough for an allocation.
+
+    The request is rounded up to the next class boundary, so any Chunk in the first non-empty class
+    at or above that will do, and is no more than one class larger than necessary. If there is no
+    such class, a Chunk in the request's own class may still be large enough, so those are tried
+    too, so that an indexed Heap never fails an allocation that first-fit would have satisfied.
+
+    \param size the size required, which must be a multiple of GRANULE
+    \returns a suitable Chunk, or nullptr if there is none
+*/
+Heap::Chunk *Heap::Index::find(uint32_t size) const {
+    unsigned fl, sl;
+    uint32_t rounded = size + (uint32_t(1) << (highest_bit(size) - SL_SHIFT)) - 1;
+    if(rounded > size) {        // i.e. it didn't overflow
+        mapping(rounded, fl, sl);
+        if(Chunk *chunk = search(fl, sl))
+            return chunk;
+    }
+    mapping(size, fl, sl);
+    for(Chunk *chunk = classes[fl][sl]; chunk; chunk = links(chunk)->class_next)
+        if(chunk->size >= size)
+            return chunk;
+    return nullptr;
+}
+
+/** Adds a Chunk to the list for its size class.
+    \param chunk the Chunk
+*/
+void Heap::Index::insert(Chunk *chunk) {
+    unsigned fl, sl;
+    mapping(chunk->size, fl, sl);
+    Links *l = links(chunk);
+    l->class_prev = nullptr;
+    l->class_next = classes[fl][sl];
+    if(l->class_next)
+        links(l->class_next)->class_prev = chunk;
+    classes[fl][sl] = chunk;
+    fl_bitmap |= uint32_t(1) << fl;
+    sl_bitmap[fl] |= 1 << sl;
+    // nothing can be larger than the bound, so a Chunk that reaches it is the largest
+    if(chunk->size >= largest) {
+        largest = chunk->size;
+        largest_exact = true;
+    }
+}
+
+/** Removes a Chunk from the list for its size class. This must be done before its size changes.
+
+    If this was the largest Chunk, \c largest is left as an upper bound rather than searched for
+    straight away, since the Chunk is usually about to be reinserted with a new size.
+
+    \param chunk the Chunk
+*/
+void Heap::Index::remove(Chunk *chunk) {
+    if(chunk->size == largest)
+        largest_exact = false;
+    unsigned fl, sl;
+    mapping(chunk->size, fl, sl);
+    Links *l = links(chunk);
+    if(l->class_next)
+        links(l->class_next)->class_prev = l->class_prev;
+    if(l->class_prev) {
+        links(l->class_prev)->class_next = l->class_next;
+    } else {
+        classes[fl][sl] = l->class_next;
+        // update the bitmaps if we've just emptied the class
+        if(!classes[fl][sl]) {
+            sl_bitmap[fl] &= ~(1 << sl);
+            if(!sl_bitmap[fl])
+                fl_bitmap &= ~(uint32_t(1) << fl);
+        }
+    }
+}
+
+/** Links a new Chunk into the Chunk list and the tree.
+    \param prev the Chunk to link it after, or nullptr to link it at the start
+    \param chunk the new Chunk, whose next pointer must already be correct
+*/
+void Heap::Index::chain(Chunk *prev, Chunk *chunk) {
+    (prev ? prev->next : heap->first) = chunk;
+    if(!chunk->next)
+        last = chunk;
+    AVLNode::add(&root, &links(chunk)->node, compare);
+}
+
+/** Unlinks a Chunk from the Chunk list and the tree.
+    \param chunk the Chunk
+*/
+void Heap::Index::unchain(Chunk *chunk) {
+    Chunk *prev = chunk_of(links(chunk)->node.prev());
+    (prev ? prev->next : heap->first) = chunk->next;
+    if(chunk == last)
+        last = prev;
+    if(chunk == rover)
+        rover = chunk->next;
+    AVLNode::remove(&root, &links(chunk)->node);
+}
+
+/** Notes that memory is about to be allocated. Whether it is known to be zero is remembered for
+    was_zero(), and it is taken out of the known-zero range, along with anything else that is about
+    to be written. That may split the range in two, in which case the smaller part is forgotten.
+    \param bottom the start of the allocation
+    \param top one past the end of the allocation
+    \param written one past the end of the memory that is about to be written, at least \a top
+*/
+void Heap::Index::dirty(char *bottom, char *top, char *written) {
+    last_zero = zero_lower <= bottom && top <= zero_upper;
+    if(written <= zero_lower || bottom >= zero_upper)
+        return;
+    size_t below = bottom > zero_lower ? bottom - zero_lower : 0;
+    size_t above = zero_upper > written ? zero_upper - written : 0;
+    if(below >= above)
+        zero_upper = zero_lower + below;
+    else
+        zero_lower = written;
+}
+
+/** Allocates memory from the top of a Chunk. Carving from the top means that the Chunk stays where
+    it is in the list and only needs to be moved to its new size class.
+    \param chunk the Chunk, which must be large enough
+    \param size the number of bytes to allocate, which must be a multiple of GRANULE
+    \returns the address of the allocated memory
+*/
+char *Heap::Index::carve(Chunk *chunk, uint32_t size) {
+    char *memory = reinterpret_cast<char *>(chunk) + chunk->size - size;
+    dirty(memory, memory + size, memory + size);
+    account(-int32_t(size));
+    remove(chunk);
+    if(chunk->size == size) {
+        unchain(chunk);
+        return memory;
+    }
+    chunk->size -= size;
+    insert(chunk);
+    return memory;
+}
+
+/** Allocates memory using the index.
+    \param size the number of bytes to allocate, which must be a multiple of GRANULE
+    \returns pointer to the new memory, or nullptr if the allocation failed
+*/
+char *Heap::Index::allocate(uint32_t size) {
+    if(size <= QUICK_CLASSES * GRANULE) {
+        unsigned q = size / GRANULE - 1;
+        if(Chunk *block = quick[q]) {
+            quick[q] = block->next;
+            --quick_count[q];
+            account(-int32_t(size));
+            last_zero = false;
+            return reinterpret_cast<char *>(block);
+        }
+    }
+    if(size > largest)
+        return nullptr;
+    if(policy == POLICY_NEXT_FIT)
+        return allocate_next(size);
+    Chunk *chunk = find(size);
+    return chunk ? carve(chunk, size) : nullptr;
+}
+
+/** Allocates memory from the first suitable Chunk at or after the rover, wrapping around to the
+    start of the Chunk list if need be. The memory is taken from the bottom of the Chunk, and the
+    rover is left on whatever remains of it, so consecutive allocations are laid out in address
+    order and the small fragments at the bottom of the heap are not searched every time.
+    \param size the number of bytes to allocate, which must be a multiple of GRANULE
+    \returns pointer to the new memory, or nullptr if the allocation failed
+*/
+char *Heap::Index::allocate_next(uint32_t size) {
+    Chunk *start = rover ? rover : heap->first;
+    if(!start)
+        return nullptr;
+    Chunk *chunk = start;
+    do {
+        if(chunk->size >= size) {
+            // unchain() moves the rover on to whatever follows the allocation
+            char *bottom = reinterpret_cast<char *>(chunk);
+            rover = chunk;
+            allocate_at(bottom, bottom + size);
+            return bottom;
+        }
+        chunk = chunk->next ? chunk->next : heap->first;
+    } while(chunk != start);
+    return nullptr;
+}
+
+/** Allocates memory from the highest suitable Chunk.
+
+    The Chunks are walked downwards from the last one through the tree, so the search stops at the
+    first Chunk that fits rather than going through the whole list. Top-down allocations tend to
+    keep the highest Chunk large, and then this is O(1).
+
+    \param size the number of bytes to allocate, which must be a multiple of GRANULE
+    \returns pointer to the new memory, or nullptr if the allocation failed
+*/
+char *Heap::Index::allocate_reverse(uint32_t size) {
+    if(size > largest)
+        return nullptr;
+    for(Chunk *chunk = last; chunk; chunk = chunk_of(links(chunk)->node.prev()))
+        if(chunk->size >= size)
+            return carve(chunk, size);
+    return nullptr;
+}
+
+/** Allocates memory at an address that is a multiple of something larger than GRANULE.
+
+    The memory is carved from the top of the Chunk at the highest suitable address, so the part of
+    the Chunk below it stays where it is, and any slack above it becomes a Chunk of its own. A Chunk
+    from the size class that allows for the worst-case slack is sure to fit; failing that, the Chunk
+    list is searched for one whose alignment happens to suit.
+
+    \param size the number of bytes to allocate, which must be a multiple of GRANULE
+    \param align the alignment, which must be a power of two larger than GRANULE
+    \returns pointer to the new memory, or nullptr if the allocation failed
+*/
+char *Heap::Index::allocate_aligned(uint32_t size, uint32_t align) {
+    if(size > largest)
+        return nullptr;
+    Chunk *chunk = size + align - GRANULE > size ? find(size + align - GRANULE) : nullptr;
+    address_t memory = 0;
+    for(Chunk *c = chunk ? chunk : heap->first; c; c = c->next) {
+        address_t cstart = reinterpret_cast<address_t>(c), cend = cstart + c->size;
+        if(c->size < size)
+            continue;
+        memory = (cend - size) & ~address_t(align - 1);
+        if(memory >= cstart)
+            break;
+        memory = 0;
+    }
+    if(!memory)
+        return nullptr;
+    char *bottom = reinterpret_cast<char *>(memory);
+    allocate_at(bottom, bottom + size);
+    return bottom;
+}
+
+/** Allocates a number of blocks of the same size, carving as many as possible out of each Chunk.
+    \param size the size of each block, which must be a multiple of GRANULE
+    \param count the number of blocks wanted
+    \param out receives the address of each block allocated
+    \returns the number of blocks allocated
+*/
+size_t Heap::Index::allocate_n(uint32_t size, size_t count, char **out) {
+    size_t n = 0;
+    while(n < count && size <= largest) {
+        Chunk *chunk = find(size);
+        if(!chunk)
+            break;
+        size_t blocks = min<size_t>(count - n, chunk->size / size);
+        char *block = carve(chunk, blocks * size);
+        for(; blocks; --blocks, block += size)
+            out[n++] = block;
+    }
+    return n;
+}
+
+/** Allocates a specific range of memory.
+    \param bottom the start of the range, which must be aligned to GRANULE
+    \param top one past the end of the range, which must be aligned to GRANULE
+    \returns true if the range was free and is now allocated, otherwise false
+*/
+bool Heap::Index::allocate_at(char *bottom, char *top) {
+    if(uint32_t(top - bottom) > largest)
+        return false;
+    // the only Chunk that could contain the range is the last one that starts at or before it
+    Chunk *chunk = below(bottom);
+    char *cstart = reinterpret_cast<char *>(chunk);
+    char *cend = cstart + (chunk ? chunk->size : 0);
+    if(!chunk || cend < top)
+        return false;
+
+    // the Chunk left over after the range gets its header and Links just above it
+    dirty(bottom, top, top < cend ? top + GRANULE : top);
+    remove(chunk);
+    // split off whatever is left after the range into a Chunk of its own
+    if(top < cend) {
+        Chunk *tail = new (top) Chunk(chunk->next, cend - top);
+        chain(chunk, tail);
+        insert(tail);
+    }
+    // and then either truncate or discard the Chunk we started with
+    if(cstart < bottom) {
+        chunk->size = bottom - cstart;
+        insert(chunk);
+    } else {
+        unchain(chunk);
+    }
+    account(-int32_t(top - bottom));
+    return true;
+}
+
+/** Releases memory. Small blocks go on a quick-list, and anything else is merged straight away.
+    Memory that is already free is ignored either way.
+    \param bottom the start of the memory, which must be aligned to GRANULE
+    \param top one past the end of the memory, which must be aligned to GRANULE
+*/
+void Heap::Index::deallocate(char *bottom, char *top) {
+    uint32_t size = top - bottom;
+    if(size <= QUICK_CLASSES * GRANULE) {
+        if(overlaps(bottom, top)) {
+            /// \bug should panic about overlapping free (AN_MemCorrupt)
+            return;
+        }
+        unsigned q = size / GRANULE - 1;
+        quick[q] = new (bottom) Chunk(quick[q], size);
+        account(size);
+        if(++quick_count[q] > QUICK_LIMIT)
+            flush_class(q);
+        return;
+    }
+    if(merge(bottom, top))
+        account(size);
+}
+
+/** Merges every block on a quick-list into the Chunks.
+    \param q the quick-list
+*/
+void Heap::Index::flush_class(unsigned q) {
+    const uint32_t size = (q + 1) * GRANULE;
+    while(Chunk *block = quick[q]) {
+        quick[q] = block->next;
+        char *bottom = reinterpret_cast<char *>(block);
+        // it was counted as free when it was deferred, so only a bad free needs accounting for
+        if(!merge(bottom, bottom + size))
+            account(-int32_t(size));
+    }
+    quick_count[q] = 0;
+}
+
+/** Merges every block on the quick-lists into the Chunks.
+    \returns true if there were any
+*/
+bool Heap::Index::flush(void) {
+    bool any = false;
+    for(unsigned q = 0; q < QUICK_CLASSES; ++q)
+        if(quick[q]) {
+            flush_class(q);
+            any = true;
+        }
+    return any;
+}
+
+/** Turns memory into a free Chunk, merging it with neighbouring Chunks where possible. The free
+    memory is left for the caller to account for.
+    \param bottom the start of the memory, which must be aligned to GRANULE
+    \param top one past the end of the memory, which must be aligned to GRANULE
+    \returns true on success, or false if the memory overlaps a free Chunk
+*/
+bool Heap::Index::merge(char *bottom, char *top) {
+    // find the Chunks immediately before and after the memory being freed
+    Chunk *previous = below(bottom);
+    Chunk *following = previous ? previous->next : heap->first;
+
+    if((following && reinterpret_cast<char *>(following) < top)
+        || (previous && reinterpret_cast<char *>(previous) + previous->size > bottom)) {
+        /// \bug should panic about overlapping free (AN_MemCorrupt)
+        return false;
+    }
+
+    // either grow the previous Chunk over the freed memory, or make a new Chunk of it
+    Chunk *chunk;
+    if(previous && reinterpret_cast<char *>(previous) + previous->size == bottom) {
+        chunk = previous;
+        remove(chunk);
+        chunk->size += top - bottom;
+    } else {
+        chunk = new (bottom) Chunk(following, top - bottom);
+        chain(previous, chunk);
+    }
+
+    // then swallow the following Chunk if it now touches, taking the rover with it
+    if(reinterpret_cast<char *>(following) == top) {
+        if(rover == following)
+            rover = chunk;
+        remove(following);
+        unchain(following);
+        chunk->size += following->size;
+    }
+
+    insert(chunk);
+    return true;
+}
+
+/** Finds the size of the largest free Chunk.
+
+    All of the Chunks in the highest non-empty size class are larger than any of the others, so
+    only that class needs to be searched when the cached size is not known to be exact.
+
+    \returns the size of the largest free Chunk, or zero if there are none
+*/
+uint32_t Heap::Index::find_largest(void) const {
+    if(!largest_exact) {
+        largest = 0;
+        if(fl_bitmap) {
+            unsigned fl = highest_bit(fl_bitmap);
+            unsigned sl = highest_bit(sl_bitmap[fl]);
+            for(Chunk *chunk = classes[fl][sl]; chunk; chunk = links(chunk)->class_next)
+                if(chunk->size > largest)
+                    largest = chunk->size;
+        }
+        largest_exact = true;
+    }
+    return largest;
+}
+
+/** Zeroes some free memory and adds it to the known-zero range.
+
+    The range is grown upwards through the free Chunk it is in, and then downwards as far as the end
+    of the Chunk's bookkeeping. Once that Chunk is done, a fresh range is started in a Chunk from the
+    highest size class, if that is larger.
+
+    \param budget the most bytes to zero
+    \returns the number of bytes zeroed, which is zero if there was nothing left to do
+*/
+size_t Heap::Index::scrub(size_t budget) {
+    Chunk *chunk = zero_lower < zero_upper ? below(zero_lower) : nullptr;
+    char *cstart = reinterpret_cast<char *>(chunk) + GRANULE;
+    char *cend = reinterpret_cast<char *>(chunk) + (chunk ? chunk->size : 0);
+    if(!chunk || (zero_lower == cstart && zero_upper == cend)) {
+        Chunk *candidate = fl_bitmap ? search(highest_bit(fl_bitmap), 0) : nullptr;
+        if(!candidate || candidate == chunk || candidate->size <= size_t(zero_upper - zero_lower) + GRANULE)
+            return 0;
+        chunk = candidate;
+        cstart = reinterpret_cast<char *>(chunk) + GRANULE;
+        cend = reinterpret_cast<char *>(chunk) + chunk->size;
+        zero_lower = zero_upper = cstart;
+    }
+
+    size_t size;
+    if(zero_upper < cend) {
+        size = min<size_t>(budget, cend - zero_upper);
+        bzero(zero_upper, size);
+        zero_upper += size;
+    } else {
+        size = min<size_t>(budget, zero_lower - cstart);
+        zero_lower -= size;
+        bzero(zero_lower, size);
+    }
+    return size;
+}
+
+/** Checks the Index against the Chunk list.
+    \returns true if the tree holds exactly the Chunks in the list, in the same order, and every
+    Chunk is filed under the right size class
+*/
+bool Heap::Index::is_sane(void) const {
+    if(!AVLNode::is_sane(root, compare))
+        return false;
+    size_t count = 0;
+    uint32_t max = 0;
+    Chunk *prev = nullptr;
+    bool found_rover = !rover;
+    const AVLNode *node = AVLNode::first(root);
+    for(Chunk *chunk = heap->first; chunk; prev = chunk, chunk = chunk->next) {
+        if(node != &links(chunk)->node)
+            return false;
+        if(chunk == rover)
+            found_rover = true;
+        if(chunk->size > max)
+            max = chunk->size;
+        node = node->next();
+        if(chunk->size < GRANULE || chunk->size % GRANULE
+            || reinterpret_cast<address_t>(chunk) % GRANULE)
+            return false;
+        // neighbouring Chunks should have been merged
+        if(prev && reinterpret_cast<char *>(prev) + prev->size >= reinterpret_cast<char *>(chunk))
+            return false;
+        ++count;
+    }
+    for(unsigned fl = 0; fl < FL_COUNT; ++fl) {
+        if(!(fl_bitmap & (uint32_t(1) << fl)) != !sl_bitmap[fl])
+            return false;
+        for(unsigned sl = 0; sl < SL_COUNT; ++sl) {
+            if(!(sl_bitmap[fl] & (1 << sl)) != !classes[fl][sl])
+                return false;
+            Chunk *class_prev = nullptr;
+            for(Chunk *chunk = classes[fl][sl]; chunk; chunk = links(chunk)->class_next) {
+                unsigned cfl, csl;
+                mapping(chunk->size, cfl, csl);
+                if(cfl != fl || csl != sl || links(chunk)->class_prev != class_prev || !count--)
+                    return false;
+                class_prev = chunk;
+            }
+        }
+    }
+    if(last != prev || !found_rover)
+        return false;
+    // the known-zero range should be inside the body of a single free Chunk
+    if(zero_lower < zero_upper) {
+        Chunk *chunk = below(zero_lower);
+        if(!chunk || zero_lower < reinterpret_cast<char *>(chunk) + GRANULE
+            || zero_upper > reinterpret_cast<char *>(chunk) + chunk->size)
+            return false;
+    }
+    // the largest Chunk should never be larger than we think
+    if(largest < max || (largest_exact && largest != max))
+        return false;
+    // deferred blocks should be the right size, and lie between the free Chunks
+    for(unsigned q = 0; q < QUICK_CLASSES; ++q) {
+        unsigned n = 0;
+        for(Chunk *block = quick[q]; block; block = block->next, ++n) {
+            char *bottom = reinterpret_cast<char *>(block);
+            Chunk *previous = below(bottom);
+            Chunk *following = previous ? previous->next : heap->first;
+            if(block->size != (q + 1) * GRANULE || reinterpret_cast<address_t>(block) % GRANULE
+                || n >= QUICK_LIMIT
+                || (previous && reinterpret_cast<char *>(previous) + previous->size > bottom)
+                || (following && reinterpret_cast<char *>(following) < bottom + block->size))
+                return false;
+        }
+        if(n != quick_count[q])
+            return false;
+    }
+    // every Chunk in the list should have been found in exactly one class, and the tree should
+    // have no more Chunks than the list
+    return count == 0 && node == nullptr;
+}
+
 // -------------------- Heap --------------------
 
 /** constructor.
@@ -106,6 +918,18 @@ Heap::Heap(size_t size_, Attributes attributes_, uint8_t priority_,
 */
 Heap *Heap::create(size_t size_, Attributes attributes_, uint8_t priority_,
                    char *base_, const char *name_) {
+    // large heaps also get an Index, which goes after the Heap structure, with the managed space
+    // then trimmed to the Index's granularity
+    if(size_ >= Index::MINIMUM_SIZE) {
+        char *lower_ = Index::align_up(base_ + sizeof(Heap) + sizeof(Index));
+        char *upper_ = Index::align_down(base_ + size_);
+        Heap *heap = new ( base_ ) Heap (
+            upper_ - lower_, attributes_, priority_, lower_, name_
+          );
+        new ( heap + 1 ) Index(heap);
+        return heap;
+    }
+
     // to initialise a heap, we merely do a placement new of a Heap structure at the start of it
     // which manages space from the end of the Heap to the end of the new block
     return new ( base_ ) Heap (
@@ -113,6 +937,20 @@ Heap *Heap::create(size_t size_, Attributes attributes_, uint8_t priority_,
       );
 }
 
+/** Finds the Index of this heap.
+
+    The Index is only looked for where Heap::create() would have put it, and only trusted if it
+    points back at this Heap.
+
+    \returns the Index, or nullptr if this heap does not have one
+*/
+Heap::Index *Heap::index(void) const {
+    Index *index = reinterpret_cast<Index *>(const_cast<Heap *>(this) + 1);
+    if(lower != Index::align_up(reinterpret_cast<char *>(index + 1)) || index->heap != this)
+        return nullptr;
+    return index;
+}
+
 /** Allocate memory from this heap.
 
     This is the underlying implementation for exec.library/Allocate().
@@ -128,6 +966,15 @@ char *Heap::allocate(size_t size) {
     // space, we immediately bail
     if(!size || size > this->free) return nullptr;
 
+    // an indexed heap can find a suitable chunk without walking the list, although the memory
+    // it needs may be on the quick-lists until they're merged
+    if(Index *index = this->index()) {
+        char *memory = index->allocate(Index::round(size));
+        if(!memory && index->flush())
+            memory = index->allocate(Index::round(size));
+        return memory;
+    }
+
     size = (size + 7) & ~7;     // round up to the next-largest multiple of 8 bytes
 
     // The pointer to the location that contains the pointer to the next memchunk. Essentially the
@@ -177,6 +1024,13 @@ char *Heap::allocate_reverse(size_t size) {
     // space, we immediately bail
     if(!size || size > this->free) return nullptr;
 
+    if(Index *index = this->index()) {
+        char *memory = index->allocate_reverse(Index::round(size));
+        if(!memory && index->flush())
+            memory = index->allocate_reverse(Index::round(size));
+        return memory;
+    }
+
     // round up to the next-largest multiple of 8 bytes
     size = (size + 7) & ~7;
 
@@ -213,6 +1067,116 @@ char *Heap::allocate_reverse(size_t size) {
     }
 }
 
+/** Allocate memory from this heap at an address that is a multiple of a given alignment.
+
+    Memory that is skipped to reach the alignment stays free as a Chunk of its own, rather than
+    being wasted by over-allocating.
+
+    \param size the number of bytes to allocate
+    \param align the alignment required, which must be a power of two
+    \returns pointer to the new memory, or nullptr if the allocation failed
+    \sa deallocate
+*/
+char *Heap::allocate_aligned(size_t size, size_t align) {
+    if(!size || size > this->free || (align & (align - 1))) return nullptr;
+
+    // everything is aligned to at least 8 bytes, and an indexed heap to a granule, anyway
+    Index *index = this->index();
+    if(align <= (index ? size_t(Index::GRANULE) : 8))
+        return allocate(size);
+    if(index) {
+        char *memory = index->allocate_aligned(Index::round(size), align);
+        if(!memory && index->flush())
+            memory = index->allocate_aligned(Index::round(size), align);
+        return memory;
+    }
+
+    return allocate_low(size, align);
+}
+
+/** Allocate memory from the bottom of the lowest Chunk that it fits in, at an address that is a
+    multiple of a given alignment.
+
+    Other allocations are carved from the tops of Chunks, so this keeps memory allocated with it
+    apart from theirs for as long as possible. It walks the Chunk list, even in an indexed Heap, so
+    is only meant for allocations that are large and few, such as the extents of LargeObjects.
+
+    \param size the number of bytes to allocate
+    \param align the alignment required, which must be a power of two
+    \returns pointer to the new memory, or nullptr if the allocation failed
+    \sa deallocate
+*/
+char *Heap::allocate_low(size_t size, size_t align) {
+    if(!size || size > this->free || (align & (align - 1))) return nullptr;
+
+    // round up to a granule, or the next-largest multiple of 8 bytes
+    size = index() ? Index::round(size) : (size + 7) & ~7;
+
+    for(Chunk *chunk = first; chunk; chunk = chunk->next) {
+        address_t cstart = reinterpret_cast<address_t>(chunk), cend = cstart + chunk->size;
+        address_t memory = (cstart + align - 1) & ~address_t(align - 1);
+        // the slack before the memory has to be large enough to stay behind as a Chunk
+        if(memory != cstart && memory - cstart < sizeof(Chunk))
+            memory += align;
+        if(memory < cend && size <= cend - memory)
+            return allocate_at(reinterpret_cast<char *>(memory), size);
+    }
+    return nullptr;
+}
+
+/** Allocate a number of blocks of the same size from this heap.
+
+    This is equivalent to calling allocate() \a count times, but carves as many blocks as it can out
+    of each Chunk it finds, so the Chunk list is only walked once.
+
+    \param size the number of bytes in each block
+    \param count the number of blocks to allocate
+    \param out receives the address of each block allocated
+    \returns the number of blocks allocated, which is less than \a count if the heap ran out
+    \sa deallocate
+*/
+size_t Heap::allocate_n(size_t size, size_t count, char **out) {
+    // cheap checks: if we were asked for no bytes, or no blocks, we immediately bail
+    if(!size || !count) return 0;
+
+    if(Index *index = this->index()) {
+        size_t n = index->allocate_n(Index::round(size), count, out);
+        if(n < count && index->flush())
+            n += index->allocate_n(Index::round(size), count - n, out + n);
+        return n;
+    }
+
+    size = (size + 7) & ~7;     // round up to the next-largest multiple of 8 bytes
+
+    size_t n = 0;
+    Chunk **pchunk = &this->first;
+    while(*pchunk && n < count && size <= this->free) {
+        Chunk *chunk = *pchunk;
+        if(chunk->size < size) {
+            pchunk = &chunk->next;
+            continue;
+        }
+
+        // carve as many blocks as we need, or as will fit, off the bottom of the Chunk
+        size_t blocks = min<size_t>(count - n, chunk->size / size);
+        size_t taken = blocks * size;
+        char *cstart = reinterpret_cast<char *>(chunk);
+        for(size_t i = 0; i < blocks; ++i)
+            out[n++] = cstart + i * size;
+        this->free -= taken;
+
+        if(chunk->size == taken) {
+            // used the whole Chunk, so unlink it
+            *pchunk = chunk->next;
+        } else {
+            // otherwise what's left becomes a new Chunk at the top
+            *pchunk = new (cstart + taken) Chunk (chunk->next, chunk->size - taken);
+            pchunk = &(*pchunk)->next;
+        }
+    }
+    return n;
+}
+
 /** Allocate memory from this heap at a specific address.
 
     \param memory the address to allocate at
@@ -228,24 +1192,34 @@ char *Heap::allocate_at(char *memory, size_t size) {
     // space, or we were asked to allocate nullptr, we immediately bail.
     if(!memory || !size || size > this->free) return nullptr;
 
+    // an indexed heap allocates whole granules, so we take those which the region touches
+    if(Index *index = this->index()) {
+        char *bottom = Index::align_down(memory), *top = Index::align_up(memory + size);
+        bool done = index->allocate_at(bottom, top);
+        if(!done && index->flush())
+            done = index->allocate_at(bottom, top);
+        return done ? memory : nullptr;
+    }
+
     size = (size + 7) & ~7; // round up to the next-largest multiple of 8 bytes
 
     Chunk **pchunk = &this->first;
     while(*pchunk) { // While the next pointer is not nullptr, i.e. there are still memchunks
         Chunk *chunk = *pchunk;
         char *cstart = reinterpret_cast<char *>(chunk);
-        if(cstart <= memory && memory + size <= cstart + chunk->size) {
+        char *cend = cstart + chunk->size;
+        if(cstart <= memory && memory + size <= cend) {
             // We've found a chunk that completely contains the memory region we were looking to
             // allocate. So we're in luck.
-            if(memory + size < cstart + chunk->size) {
+            if(memory + size < cend) {
                 // need to create new chunk between end of allocated block and end of the chunk, and
                 // link it in. This temporarily creates an overlap with "chunk" but that's OK as
                 // we're about to truncate or unlink that Chunk.
-                chunk->next = new (memory + size) Chunk(chunk->next, chunk->size - size);
+                chunk->next = new (memory + size) Chunk(chunk->next, cend - (memory + size));
             }
             if(cstart < memory) {
-                // need to truncate chunk
-                chunk->size -= size;
+                // need to truncate chunk so that it ends where the allocated block starts
+                chunk->size = memory - cstart;
             } else {
                 // need to unlink chunk
                 *pchunk = chunk->next;
@@ -260,20 +1234,87 @@ char *Heap::allocate_at(char *memory, size_t size) {
     return nullptr;
 }
 
-/** Release memory from this heap.
+/** Resize memory from this heap in place.
 
-    This is the underlying implementation of exec.library/Deallocate().
+    Shrinking gives the tail of the memory back to the heap, where it straight away becomes a Chunk
+    of its own or merges with the free memory after it. Growing takes the free memory immediately after the
+    allocation, if there is enough of it. Nothing is ever moved, so if that fails it's up to the
+    caller to allocate, copy and free, as HeapList::reallocate() does.
 
     \param memory the memory previously allocated
     \param size the number of bytes previously allocated
-    \sa allocate, allocate_reverse, allocate_at
+    \param new_size the number of bytes wanted; zero frees the memory
+    \returns \a memory if it now holds \a new_size bytes, or nullptr if it was freed or could not be
+    grown, in which case it is unchanged
+    \sa allocate, deallocate, HeapList::reallocate
 */
-void Heap::deallocate(char *memory, size_t size) {
-    // cheap checks: if we were asked to free nullptr, or no bytes, we immediately bail
-    if(!memory || !size) return;
-
-    /// \todo should reduce memory and increase size if memory is not 8-byte aligned
-    size = (size + 7) & ~7;     // round up to the next-largest multiple of 8 bytes
+char *Heap::reallocate(char *memory, size_t size, size_t new_size) {
+    if(!memory || !size) return nullptr;
+    if(!new_size) {
+        deallocate(memory, size);
+        return nullptr;
+    }
+
+    // both ends are rounded the same way that allocate_at() and deallocate() round them: an
+    // indexed heap deals in whole granules, and any other heap in multiples of 8 bytes
+    char *end, *new_end;
+    if(index()) {
+        end = Index::align_up(memory + size);
+        new_end = Index::align_up(memory + new_size);
+    } else {
+        end = memory + ((size + 7) & ~7);
+        new_end = memory + ((new_size + 7) & ~7);
+    }
+    if(new_end < end) {
+        // an indexed heap merges the tail straight into its Chunks rather than deferring it on a
+        // quick-list, where it would be kept apart from the free memory after it
+        Index *index = this->index();
+        if(!index)
+            deallocate(new_end, end - new_end);
+        else if(index->merge(new_end, end))
+            index->account(end - new_end);
+    } else if(new_end > end && !allocate_at(end, new_end - end))
+        return nullptr;
+    return memory;
+}
+
+/** Release memory from this heap.
+
+    This is the underlying implementation of exec.library/Deallocate().
+
+    \param memory the memory previously allocated
+    \param size the number of bytes previously allocated
+    \sa allocate, allocate_reverse, allocate_at
+*/
+void Heap::deallocate(char *memory, size_t size) {
+    release(nullptr, memory, size);
+}
+
+/** Release memory from this heap, starting the search for its neighbours part way along the list.
+
+    This allows a batch of deallocations in ascending address order to be done in a single pass
+    over the Chunk list, as HeapList::deallocate_multiple() does, by passing the result of each call
+    as the \a hint for the next.
+
+    \param hint a Chunk that starts below \a memory to search from, or nullptr to search from the
+    start of the list
+    \param memory the memory previously allocated
+    \param size the number of bytes previously allocated
+    \returns a Chunk that is below any memory after this, for use as the next \a hint
+*/
+Heap::Chunk *Heap::release(Chunk *hint, char *memory, size_t size) {
+    // cheap checks: if we were asked to free nullptr, or no bytes, we immediately bail
+    if(!memory || !size) return hint;
+
+    // an indexed heap releases the whole granules that the memory touches, to match allocate_at().
+    // It doesn't need a hint as it finds the neighbouring Chunks from its tree.
+    if(Index *index = this->index()) {
+        index->deallocate(Index::align_down(memory), Index::align_up(memory + size));
+        return nullptr;
+    }
+
+    /// \todo should reduce memory and increase size if memory is not 8-byte aligned
+    size = (size + 7) & ~7;     // round up to the next-largest multiple of 8 bytes
 
     // update free space
     this->free += size;
@@ -282,8 +1323,8 @@ void Heap::deallocate(char *memory, size_t size) {
     // \c memory and return, but that will leave the memory horribly fragmented. So we actually need
     // to merge this proposed Chunk with the previous or subsequent Chunk that it touches.
 
-    Chunk **pchunk = &this->first; // pointer to pointer to tested Chunk
-    Chunk *previous = nullptr;        // previous Chunk, if there is any
+    Chunk **pchunk = hint ? &hint->next : &this->first; // pointer to pointer to tested Chunk
+    Chunk *previous = hint;                             // previous Chunk, if there is any
     // We want to find the Chunk just ahead of us.
     while(*pchunk) {        // While the next pointer is not nullptr, i.e. there are still memchunks
         Chunk *chunk = *pchunk;
@@ -310,7 +1351,7 @@ void Heap::deallocate(char *memory, size_t size) {
             mc_next = mc_next->next;
         } else if(cnext < memory + size) {
             /// \bug should panic about overlapping free (AN_MemCorrupt)
-            return;
+            return previous;
         }
     }
 
@@ -322,18 +1363,28 @@ void Heap::deallocate(char *memory, size_t size) {
             // blocks are right together, so merge.
             previous->size += size;
             previous->next = mc_next;
-            return;
+            return previous;
         } else if(ptop > memory) {
             /// \bug should panic about overlapping free (AN_MemCorrupt)
-            return;
+            return previous;
         }
     }
 
     // Now create and link in a new free Chunk
-    *pchunk = new (memory) Chunk(mc_next, size);
+    return *pchunk = new (memory) Chunk(mc_next, size);
 }
 
-/** Counts the chunks in this heap.
+/** Merges any small blocks whose freeing was deferred into the Chunk list, so that it shows the
+    free memory exactly as it will be allocated from. Only indexed heaps defer anything.
+    \returns true if there were any
+*/
+bool Heap::flush(void) {
+    Index *index = this->index();
+    return index && index->flush();
+}
+
+/** Counts the chunks in this heap. Blocks whose freeing was deferred are counted as they stand,
+    one each, so call flush() first to count the chunks they would merge into.
 
     This is primarily used by the test suite to check that the allocator is working properly. You do
     not normally need to know this.
@@ -347,10 +1398,13 @@ size_t Heap::count_chunks(void) const {
         ++count;
         chunk = chunk->next;
     };
+    if(const Index *index = this->index())
+        for(unsigned q = 0; q < Index::QUICK_CLASSES; ++q)
+            count += index->quick_count[q];
     return count;
 }
 
-/** Counts the free space in this heap.
+/** Counts the free space in this heap, including blocks whose freeing was deferred.
 
     This is an O(N) search and is primarily used by the test suite to check that the allocator is
     working properly. You probably want to use Heap::available() which is O(1).
@@ -364,9 +1418,153 @@ size_t Heap::count_free(void) const {
         count += chunk->size;
         chunk = chunk->next;
     };
+    if(const Index *index = this->index())
+        for(unsigned q = 0; q < Index::QUICK_CLASSES; ++q)
+            count += index->quick_count[q] * (q + 1) * Index::GRANULE;
     return count;
 }
 
+/** Finds the size of the largest free chunk in this heap, which can always be allocated. Blocks
+    whose freeing was deferred may merge into a larger one, so call flush() first for an exact
+    figure.
+
+    This is O(1) for an indexed heap, which keeps track of it, but has to walk the Chunk list of any
+    other heap.
+
+    \returns the size of the largest free chunk, in bytes
+*/
+size_t Heap::largest(void) const {
+    if(const Index *index = this->index()) {
+        size_t size = index->find_largest();
+        // the deferred blocks are only ever a granule or two, but may be all there is
+        for(unsigned q = 0; q < Index::QUICK_CLASSES; ++q)
+            if(index->quick[q] && (q + 1) * Index::GRANULE > size)
+                size = (q + 1) * Index::GRANULE;
+        return size;
+    }
+    size_t size = 0;
+    for(Chunk *chunk = first; chunk; chunk = chunk->next)
+        if(chunk->size > size)
+            size = chunk->size;
+    return size;
+}
+
+/** Measures how fragmented this heap is [Openkick HeapStatistics()]. This walks the Chunk list,
+    so is O(N) in the number of free Chunks. Blocks whose freeing was deferred are counted as the
+    separate Chunks that they still are, so call flush() first to measure the heap as it will be
+    allocated from.
+    \param stats where to put the results
+*/
+void Heap::statistics(Statistics *stats) const {
+    stats->clear();
+    for(Chunk *chunk = first; chunk; chunk = chunk->next) {
+        stats->free += chunk->size;
+        ++stats->chunks;
+        if(chunk->size > stats->largest)
+            stats->largest = chunk->size;
+        ++stats->histogram[highest_bit(chunk->size)];
+    }
+    if(const Index *index = this->index())
+        for(unsigned q = 0; q < Index::QUICK_CLASSES; ++q)
+            for(const Chunk *block = index->quick[q]; block; block = block->next) {
+                stats->free += block->size;
+                ++stats->chunks;
+                if(block->size > stats->largest)
+                    stats->largest = block->size;
+                ++stats->histogram[highest_bit(block->size)];
+            }
+    stats->finish();
+}
+
+/** Finds how this heap chooses which free Chunk to allocate from.
+    \returns the policy; heaps without an Index always use first fit, which is reported as
+    POLICY_GOOD_FIT
+*/
+Heap::Policy Heap::policy(void) const {
+    Index *index = this->index();
+    return index ? index->policy : POLICY_GOOD_FIT;
+}
+
+/** Finds whether the memory most recently allocated from this heap was already known to be zero, so
+    that MEMF_CLEAR can skip clearing it.
+    \returns true if it was; always false for heaps without an Index
+*/
+bool Heap::was_zero(void) const {
+    Index *index = this->index();
+    return index && index->last_zero;
+}
+
+/** Stops other tasks from using this heap until unlock() is called. It is only held while the heap
+    is being searched or changed, and not while the Heap is chosen or the memory cleared.
+
+    A heap with an Index has a lock bit of its own in it, so task switching carries on, and tasks
+    using other heaps aren't held up at all. Calls mustn't be nested. A task that finds the bit set
+    waits for it with ExecBase::wait_for_lock(), which breaks a Forbid() as Wait() does, since the
+    holder may need to run to let go. Heaps without an Index have nowhere to keep a bit, so they
+    are locked with Forbid(), which may be nested. Before ExecBase exists there is nothing to
+    Forbid() with, so allocations made then must use HeapList::allocate_early(), which doesn't
+    lock.
+
+    Every change to a Heap in the system HeapList has to be made with it locked, even in Forbid(),
+    or it could come in the middle of a change that a task switched out has yet to finish.
+*/
+void Heap::lock(void) const {
+    if(Index *index = this->index()) {
+        while(test_and_set(&index->locked)) {
+#ifndef HOSTED_TEST
+            execbase->wait_for_lock(&index->locked);
+#endif
+        }
+        return;
+    }
+#ifndef HOSTED_TEST
+    execbase->forbid();
+#endif
+}
+
+/** Lets other tasks use this heap again after lock(). */
+void Heap::unlock(void) const {
+    if(Index *index = this->index()) {
+#ifdef HOSTED_TEST
+        __atomic_clear(&index->locked, __ATOMIC_RELEASE);
+#else
+        asm volatile("" : : : "memory");
+        index->locked = 0;
+#endif
+        return;
+    }
+#ifndef HOSTED_TEST
+    execbase->Permit();
+#endif
+}
+
+/** Zeroes some of the free memory in this heap, so that later MEMF_CLEAR allocations don't have to.
+    This is meant to be done a little at a time while the system is idle.
+    \param budget the most bytes to zero
+    \returns the number of bytes zeroed, which is zero if there is nothing left to do
+*/
+size_t Heap::scrub(size_t budget) {
+    Index *index = this->index();
+    return index ? index->scrub(budget) : 0;
+}
+
+/** Changes how this heap chooses which free Chunk to allocate from.
+
+    The policy lives in the heap's Index, so heaps without one keep to first fit.
+
+    \param policy_ the new policy
+    \returns true if the policy was changed, or false if this heap has no Index or the policy is
+    unknown
+*/
+bool Heap::set_policy(Policy policy_) {
+    Index *index = this->index();
+    if(!index || policy_ > POLICY_NEXT_FIT)
+        return false;
+    index->policy = policy_;
+    index->rover = nullptr;
+    return true;
+}
+
 /** Checks if this heap is sane.
 
     This is primarily used by the test suite to check that the allocator is working properly.
@@ -381,9 +1579,44 @@ bool Heap::is_sane(void) const {
             return false;
         chunk = chunk->next;
     }
+    // and an indexed heap's index needs to agree with the list
+    if(const Index *index = this->index())
+        return index->is_sane();
     return true;
 }
 
+// -------------------- Heap::Statistics --------------------
+
+/** Empties the statistics, ready for adding to. */
+void Heap::Statistics::clear(void) {
+    free = chunks = largest = 0;
+    fragmentation = 0;
+    for(size_t n = 0; n < BUCKETS; ++n)
+        histogram[n] = 0;
+}
+
+/** Adds in the statistics of another heap. The fragmentation is left for finish() to work out.
+    \param that the statistics to add
+*/
+void Heap::Statistics::add(const Statistics *that) {
+    free += that->free;
+    chunks += that->chunks;
+    if(that->largest > largest)
+        largest = that->largest;
+    for(size_t n = 0; n < BUCKETS; ++n)
+        histogram[n] += that->histogram[n];
+}
+
+/** Works out the fragmentation from the free and largest sizes. */
+void Heap::Statistics::finish(void) {
+    uint32_t total = free, most = largest;
+    // scale both down so that the multiplication can't overflow
+    while(total > 0x3fffff) {
+        total >>= 1;
+        most >>= 1;
+    }
+    fragmentation = total ? 1000 - most * 1000 / total : 0;
+}
 
 // -------------------- HeapList --------------------
 
@@ -406,36 +1639,187 @@ HeapList::HeapList(HeapList *that)
         add(heap);
 }
 
+/** Allocate memory from a particular Heap, honouring the allocation options. The Heap is locked
+    while the memory is taken from it, but not while the memory is cleared, which can take much
+    longer.
+    \param heap the Heap
+    \param size the number of bytes to allocate
+    \param options the allocation options
+    \param locking false if there is no ExecBase yet, so nothing to lock the Heap with
+    \returns pointer to the new memory, or nullptr if the allocation failed
+*/
+char *HeapList::take(Heap *heap, size_t size, Heap::Options options, bool locking) {
+    char *mem;
+    if(locking)
+        heap->lock();
+    if((unsigned)options & (unsigned)Heap::MEMF_REVERSE) {
+        mem = heap->allocate_reverse(size);
+    } else {
+        mem = heap->allocate(size);
+    }
+    bool zero = heap->was_zero();
+    if(locking)
+        heap->unlock();
+    if(mem && ((unsigned)options & (unsigned)Heap::MEMF_CLEAR) && !zero)
+        bzero(mem, size);
+    return mem;
+}
+
 /** Allocate memory.
-    This is the underlying implementation for exec.library/AllocMem().
+
+    This is the underlying implementation for exec.library/AllocMem(). Classically, the memory comes
+    from the first Heap in priority order that has the right attributes and enough room, which is
+    SELECT_PRIORITY. That tends to leave Fast RAM in fragments and fail large DMA requests later, so
+    there are two alternatives:
+
+    - SELECT_BEST_FIT picks the Heap whose largest free Chunk is the smallest that will do, which
+    leaves the large Chunks elsewhere alone.
+
+    - SELECT_SPARE_CHIP tries every other Heap before Chip RAM, unless Chip RAM was asked for, to
+    keep it free for the custom chips.
+
+    If nothing fits, the low-memory handlers are given a chance to free something, unless
+    MEMF_NO_EXPUNGE was given.
+
+    The caller needn't lock anything: each Heap is locked only while it is being searched, so the
+    attributes are checked and the Heap chosen with task switching enabled. Heaps may be added
+    meanwhile, but are never removed, and the list is stepped through with advance() so that one
+    being added isn't seen half linked in.
+
     \param size the number of bytes to allocate
-    \param requirements the allocation requirements
+    \param attributes the attributes of the memory required
+    \param options the allocation options
+    \param selection how to choose the Heap
+    \param handlers the low-memory handlers to call if the allocation fails, or nullptr
     \returns pointer to the new memory, or nullptr if the allocation failed
     \sa deallocate
 */
-char *HeapList::allocate(size_t size, Heap::Attributes attributes, Heap::Options options) {
-    char *mem = nullptr;
-    iterator i = begin(), e = end();
-    while(!mem && i != e) {
-        Heap *heap = *i++;
+char *HeapList::allocate(size_t size, Heap::Attributes attributes, Heap::Options options,
+                         Selection selection, MemHandlerList *handlers) {
+    char *mem;
+    if(selection == SELECT_BEST_FIT) {
+        Heap *best = nullptr;
+        size_t best_largest = 0;
+        for(iterator i = begin(), e = end(); i != e; advance(i)) {
+            Heap *heap = *i;
+            if(!heap->provides(attributes) || heap->available() < size)
+                continue;
+            heap->lock();
+            size_t largest = heap->largest();
+            heap->unlock();
+            if(largest >= size && (!best || largest < best_largest)) {
+                best = heap;
+                best_largest = largest;
+            }
+        }
+        // rounding may mean that it doesn't fit after all, in which case we carry on as usual
+        if(best && (mem = take(best, size, options)))
+            return mem;
+    }
+
+    bool spare_chip = selection == SELECT_SPARE_CHIP
+        && !((unsigned)attributes & (unsigned)Heap::MEMF_CHIP);
+    for(iterator i = begin(), e = end(); i != e; advance(i)) {
+        Heap *heap = *i;
         // if the memory pool described by the Heap is of the right type, try to allocate the memory
         // from the pool and return it. Otherwise, fall through and try the next Heap.
-        if(heap->provides(attributes)) {
-            if((unsigned)options & (unsigned)Heap::MEMF_REVERSE) {
-                mem = heap->allocate_reverse(size);
-            } else {
-                mem = heap->allocate(size);
-            }
-            if(mem) {
-                if((unsigned)options & (unsigned)Heap::MEMF_CLEAR)
-                    bzero(mem, size);
+        if(heap->provides(attributes) && !(spare_chip && heap->provides(Heap::MEMF_CHIP))
+            && (mem = take(heap, size, options)))
+            return mem;
+    }
+    if(spare_chip)
+        for(iterator i = begin(), e = end(); i != e; advance(i)) {
+            Heap *heap = *i;
+            if(heap->provides(attributes) && heap->provides(Heap::MEMF_CHIP)
+                && (mem = take(heap, size, options)))
                 return mem;
-            }
+        }
+    if(handlers && !((unsigned)options & (unsigned)Heap::MEMF_NO_EXPUNGE))
+        return handlers->relieve(this, size, attributes, options, selection);
+    return nullptr;
+}
+
+/** Allocate memory while the system is starting up, before there is an ExecBase. This is as
+    allocate() with SELECT_PRIORITY, except that the Heaps aren't locked, as Heap::lock() needs
+    ExecBase, and there are no low-memory handlers to call.
+    \param size the number of bytes to allocate
+    \param attributes the attributes of the memory required
+    \param options the allocation options
+    \returns pointer to the new memory, or nullptr if the allocation failed
+    \sa allocate
+*/
+char *HeapList::allocate_early(size_t size, Heap::Attributes attributes, Heap::Options options) {
+    char *mem;
+    for(iterator i = begin(), e = end(); i != e; ++i)
+        if((*i)->provides(attributes) && (mem = take(*i, size, options, false)))
+            return mem;
+    return nullptr;
+}
+
+/** Allocate memory at an address that is a multiple of a given alignment, such as the 8 bytes
+    needed for AGA 64-bit bitplane fetches, or the 16 bytes for move16.
+    \param size the number of bytes to allocate
+    \param align the alignment required, which must be a power of two
+    \param attributes the attributes of the memory required
+    \param options the allocation options; MEMF_REVERSE is ignored
+    \returns pointer to the new memory, or nullptr if the allocation failed
+    \sa deallocate
+*/
+char *HeapList::allocate_aligned(size_t size, size_t align,
+                                 Heap::Attributes attributes, Heap::Options options) {
+    for(iterator i = begin(), e = end(); i != e; advance(i)) {
+        Heap *heap = *i;
+        if(!heap->provides(attributes))
+            continue;
+        heap->lock();
+        char *mem = heap->allocate_aligned(size, align);
+        bool zero = heap->was_zero();
+        heap->unlock();
+        if(mem) {
+            if(((unsigned)options & (unsigned)Heap::MEMF_CLEAR) && !zero)
+                bzero(mem, size);
+            return mem;
         }
     }
     return nullptr;
 }
 
+/** Allocate a number of blocks of the same size.
+
+    This is equivalent to calling allocate() \a count times, but each Heap is only searched once.
+    Blocks may come from more than one Heap.
+
+    \param size the number of bytes in each block
+    \param count the number of blocks to allocate
+    \param out receives the address of each block allocated
+    \param attributes the attributes of the memory required
+    \param options the allocation options
+    \returns the number of blocks allocated, which is less than \a count if memory ran out
+    \sa deallocate, deallocate_multiple
+*/
+size_t HeapList::allocate_n(size_t size, size_t count, char **out,
+                            Heap::Attributes attributes, Heap::Options options) {
+    size_t n = 0;
+    for(iterator i = begin(), e = end(); n < count && i != e; advance(i)) {
+        Heap *heap = *i;
+        if(!heap->provides(attributes))
+            continue;
+        heap->lock();
+        if((unsigned)options & (unsigned)Heap::MEMF_REVERSE) {
+            // there's no bulk equivalent, so fall back to doing them one at a time
+            while(n < count && (out[n] = heap->allocate_reverse(size)))
+                ++n;
+        } else {
+            n += heap->allocate_n(size, count - n, out + n);
+        }
+        heap->unlock();
+    }
+    if((unsigned)options & (unsigned)Heap::MEMF_CLEAR)
+        for(size_t i = 0; i < n; ++i)
+            bzero(out[i], size);
+    return n;
+}
+
 /** Allocate memory at a specific address.
     This is the underlying implementation for exec.library/AllocAbs().
     \param address the address to allocate at
@@ -448,14 +1832,102 @@ char *HeapList::allocate(size_t size, Heap::Attributes attributes, Heap::Options
     mark the space as being free.
 */
 char *HeapList::allocate_at(char *address, size_t size) {
-    for(iterator i = begin(); i != end(); ++i) {
-        Heap *heap = *i;
-        if(heap->contains(address))
-            return heap->allocate_at(address, size);
-    }
+    Heap *heap = find(address);
+    if(!heap)
+        return nullptr;
+    heap->lock();
+    char *mem = heap->allocate_at(address, size);
+    heap->unlock();
+    return mem;
+}
+
+/** Moves an iterator on to the next Heap. Task switching is disabled for just long enough to follow
+    the link, so that a Heap that AddMemList() is adding meanwhile is either seen whole or not at
+    all.
+    \param i the iterator
+*/
+void HeapList::advance(iterator &i) {
+#ifndef HOSTED_TEST
+    execbase->forbid();
+#endif
+    ++i;
+#ifndef HOSTED_TEST
+    execbase->Permit();
+#endif
+}
+
+/** Finds the Heap that contains an address.
+    \param address the address
+    \returns the Heap, or nullptr if the address is not in any of them
+    \sa HeapTable::find
+*/
+Heap *HeapList::find(const char *address) const {
+    for(const_iterator i = begin(); i != end(); ++i)
+        if((*i)->contains(address))
+            return const_cast<Heap *>(*i);
     return nullptr;
 }
 
+/** Resize memory.
+
+    The memory is resized in place if the Heap it came from allows that, and otherwise moved to a
+    new allocation, so peak usage and copying are only paid for when there's no other way.
+
+    \param address the memory previously allocated, or nullptr to make a new allocation
+    \param size the number of bytes previously allocated
+    \param new_size the number of bytes wanted; zero frees the memory
+    \param attributes the attributes of the memory required if it has to move
+    \param options the allocation options; MEMF_CLEAR clears any memory added to the end, and
+    MEMF_REVERSE applies if the memory has to move
+    \param memory the MemoryState that the memory may have come from, which is used to allocate
+    and free it, or nullptr if it came from the Heaps alone
+    \returns the address of the resized memory, or nullptr if it was freed or there was no memory
+    to grow it, in which case it is unchanged
+    \sa allocate, deallocate, Heap::reallocate
+*/
+char *HeapList::reallocate(char *address, size_t size, size_t new_size,
+                           Heap::Attributes attributes, Heap::Options options,
+                           MemoryState *memory) {
+    Heap::Options move_options = Heap::Options(options & ~Heap::MEMF_CLEAR);
+    if(!address)
+        return memory ? memory->allocate(new_size, attributes, options)
+            : allocate(new_size, attributes, options);
+
+    char *mem = nullptr;
+    if(memory && memory->owns(address)) {
+        // neither granules nor extents can be resized in place, so they always move
+        if(new_size && !(mem = memory->allocate(new_size, attributes, move_options)))
+            return nullptr;
+        if(mem)
+            memcpy(mem, address, min(size, new_size));
+        memory->deallocate(address, size);
+    } else {
+        Heap *heap = memory ? memory->heap_table.find(address) : find(address);
+        if(!heap) {
+            /// \bug should oops about bad free address (AN_BadFreeAddr)
+            return nullptr;
+        }
+
+        heap->lock();
+        mem = heap->reallocate(address, size, new_size);
+        heap->unlock();
+        if(!mem && new_size) {
+            // no room to grow in place, so it has to move
+            mem = memory ? memory->allocate(new_size, attributes, move_options)
+                : allocate(new_size, attributes, move_options);
+            if(!mem)
+                return nullptr;
+            memcpy(mem, address, size);
+            heap->lock();
+            heap->deallocate(address, size);
+            heap->unlock();
+        }
+    }
+    if(mem && new_size > size && ((unsigned)options & (unsigned)Heap::MEMF_CLEAR))
+        bzero(mem + size, new_size - size);
+    return mem;
+}
+
 /** Release memory.
     This is the underlying implementation of exec.library/FreeMem().
     \param address the memory previously allocated
@@ -463,10 +1935,11 @@ char *HeapList::allocate_at(char *address, size_t size) {
     \sa allocate, allocate_reverse, allocate_at
 */
 void HeapList::deallocate(char *address, size_t size) {
-    for(iterator i = begin(); i != end(); ++i) {
-        Heap *heap = *i;
-        if(heap->contains(address))
-            return heap->deallocate(address, size);
+    if(Heap *heap = find(address)) {
+        heap->lock();
+        heap->deallocate(address, size);
+        heap->unlock();
+        return;
     }
     /// \bug should oops about bad free address (AN_BadFreeAddr)
 }
@@ -485,12 +1958,11 @@ size_t HeapList::available(Heap::Attributes attributes, Heap::Options options) c
                 // MEMF_TOTAL doesn't actually seem to be documented
                 size += heap->upper - heap->lower;
             } else if((unsigned)options & (unsigned)Heap::MEMF_LARGEST) {
-                Heap::Chunk *chunk = heap->first;
-                while(chunk) {
-                    if(chunk->size > size)
-                        size = chunk->size;
-                    chunk = chunk->next;
-                }
+                heap->lock();
+                size_t largest = heap->largest();
+                heap->unlock();
+                if(largest > size)
+                    size = largest;
             } else {
                 size += heap->free;
             }
@@ -505,13 +1977,25 @@ size_t HeapList::available(Heap::Attributes attributes, Heap::Options options) c
     \returns the memory's attributes
 */
 Heap::Attributes HeapList::type(const char *address) const {
-    for(const_iterator i = begin(); i != end(); ++i) {
-        const Heap *heap = *i;
-        if(heap->contains(address))
-            return heap->attributes;
-    }
+    const Heap *heap = find(address);
     // classic AmigaOS returns zero.
-    return Heap::MEMF_ANY;
+    return heap ? heap->attributes : Heap::MEMF_ANY;
+}
+
+/** Measures how fragmented the system memory is as a whole [Openkick HeapStatistics()]. The
+    largest free Chunk is the largest in any one Heap.
+    \param stats where to put the results
+*/
+void HeapList::statistics(Heap::Statistics *stats) const {
+    Heap::Statistics heap_stats;
+    stats->clear();
+    for(const_iterator i = begin(), e = end(); i != e; ++i) {
+        (*i)->lock();
+        (*i)->statistics(&heap_stats);
+        (*i)->unlock();
+        stats->add(&heap_stats);
+    }
+    stats->finish();
 }
 
 /** Adds a new Heap to the system.
@@ -535,13 +2019,43 @@ void HeapList::add(size_t size, Heap::Attributes attributes, uint8_t priority,
     this->enqueue(heap);
 }
 
+/** Zeroes some free memory, so that later MEMF_CLEAR allocations don't have to. Heaps are done in
+    priority order, so the memory that is allocated first is ready first.
+    \param budget the most bytes to zero
+    \returns the number of bytes zeroed, which is zero if there is nothing left to do
+*/
+size_t HeapList::scrub(size_t budget) {
+    size_t size = 0;
+    for(iterator i = begin(), e = end(); size < budget && i != e; advance(i)) {
+        (*i)->lock();
+        size += (*i)->scrub(budget - size);
+        (*i)->unlock();
+    }
+    return size;
+}
+
+/** Merges the deferred frees of every Heap into its Chunk list; see Heap::flush().
+    \returns true if there were any
+*/
+bool HeapList::flush(void) {
+    bool any = false;
+    for(iterator i = begin(), e = end(); i != e; advance(i)) {
+        (*i)->lock();
+        any |= (*i)->flush();
+        (*i)->unlock();
+    }
+    return any;
+}
+
 /** Atomic allocation of multiple requests.
     This is the underlying implementation of exec.library/AllocEntry().
     \param request A MemEntryRequest * describing the requests
+    \param memory the MemoryState to allocate each request through, as AllocMem() does, or nullptr
+    to allocate from the Heaps alone
     \returns a MemEntryResponse describing the allocated memory or failure
     \bug this code is suspected to be broken
 */
-MemEntryResponse HeapList::allocate_multiple(const MemEntry *request) {
+MemEntryResponse HeapList::allocate_multiple(const MemEntry *request, MemoryState *memory) {
     // first step, obtain a MemEntry structure \todo generate size from sizeof etc
     size_t me_size = 2 + 4 * request->count;
     MemEntry *me = allocate_mementry(request->count);
@@ -553,9 +2067,9 @@ MemEntryResponse HeapList::allocate_multiple(const MemEntry *request) {
     // success or the size of the failed allocation.
     size_t failed = 0;
     for(size_t i = 0; i < request->count; ++i) {
-        char *mem = allocate(
-            request->entries[i].size, request->entries[i].attributes, request->entries[1].options
-          );
+        const MemEntry::Entry &entry = request->entries[i];
+        char *mem = memory ? memory->allocate(entry.size, entry.attributes, entry.options)
+            : allocate(entry.size, entry.attributes, entry.options);
         me->entries[i].addr = mem;
         me->entries[i].size = request->entries[i].size;
         if(!mem)
@@ -568,22 +2082,138 @@ MemEntryResponse HeapList::allocate_multiple(const MemEntry *request) {
 
     // we failed, so release anything we have allocated so far, and return
     // the size of the failed request
-    deallocate_multiple(me);
+    deallocate_multiple(me, memory);
     return MemEntryResponse(failed);
 }
 
 /** Atomic deallocation of multiple requests.
     This is the underlying implementation of exec.library/FreeEntry().
     \param me the MemEntry * obtained via allocate_multiple().
+    \param memory the MemoryState that it was allocated through, or nullptr
     \note \c me is also released and the pointer is invalid after the call.
 */
-void HeapList::deallocate_multiple(MemEntry *me) {
-    for(size_t i = 0; i < me->count; ++i) {
-        deallocate(me->entries[i].addr, me->entries[i].size);
-    }
+void HeapList::deallocate_multiple(MemEntry *me, MemoryState *memory) {
+    deallocate_multiple(me->entries, me->count, memory);
     deallocate_mementry(me);
 }
 
+/** Sorts indices into a batch of entries by the entries' addresses. Short runs are insertion
+    sorted, as batches are often already in order; longer ones are merge sorted, so that a MemEntry
+    of thousands of entries doesn't take millions of comparisons.
+    \param entries the entries
+    \param order the indices to sort
+    \param scratch room for at least half as many indices again
+    \param n the number of indices
+*/
+static void sort_by_address(const MemEntry::Entry *entries, uint16_t *order, uint16_t *scratch,
+                            size_t n) {
+    if(n <= 16) {
+        for(size_t i = 1; i < n; ++i) {
+            uint16_t index = order[i];
+            size_t j = i;
+            for(; j > 0 && entries[order[j - 1]].addr > entries[index].addr; --j)
+                order[j] = order[j - 1];
+            order[j] = index;
+        }
+        return;
+    }
+    size_t half = n / 2;
+    sort_by_address(entries, order, scratch, half);
+    sort_by_address(entries, order + half, scratch, n - half);
+    if(entries[order[half - 1]].addr <= entries[order[half]].addr)
+        return;
+    // merge the lower half, moved aside, with the upper one in place
+    memcpy(scratch, order, half * sizeof(*order));
+    size_t i = 0, j = half, k = 0;
+    while(i < half && j < n)
+        order[k++] = entries[order[j]].addr < entries[scratch[i]].addr ? order[j++] : scratch[i++];
+    while(i < half)
+        order[k++] = scratch[i++];
+}
+
+/** Releases a batch of memory.
+
+    The batch is sorted by address first, through a list of indices so that the entries themselves
+    are left alone. Each Heap's share of it is then contiguous, so the owning Heap only needs to be
+    found once per share rather than once per entry, and the share can be merged into the Heap in a
+    single pass over its Chunk list. The indices of a short batch are kept on the stack, and those
+    of a longer one in memory allocated for the purpose; only if that can't be had is the batch
+    sorted and released a stackful at a time.
+
+    Given a MemoryState, each entry is offered to it first, as memory from its Chip RAM pages and
+    extents is inside a Heap but mustn't go back to it directly; its HeapTable is used to find the
+    rest's Heaps. Each Heap is locked for its share.
+
+    \param entries the (address, size) pairs to release. Entries with a nullptr address are skipped.
+    \param count the number of entries, which fits in the 16 bits of MemEntry::count
+    \param memory the MemoryState that they were allocated through, or nullptr to search the list
+*/
+void HeapList::deallocate_multiple(const MemEntry::Entry *entries, size_t count,
+                                   MemoryState *memory) {
+    const size_t STACK = 32;
+    uint16_t stack[STACK + STACK / 2];
+    uint16_t *order = stack;
+    size_t batch = STACK, bytes = 0;
+    if(count > STACK) {
+        bytes = (count + count / 2) * sizeof(*order);
+        if(char *buffer = allocate(bytes, Heap::MEMF_PUBLIC, Heap::MEMF_NONE)) {
+            order = reinterpret_cast<uint16_t *>(buffer);
+            batch = count;
+        } else {
+            bytes = 0;
+        }
+    }
+
+    for(; count; entries += batch, count -= min(count, batch)) {
+        size_t n = min(count, batch);
+        for(size_t i = 0; i < n; ++i)
+            order[i] = i;
+        sort_by_address(entries, order, order + batch, n);
+
+        Heap *heap = nullptr;
+        Heap::Chunk *hint = nullptr;
+        for(size_t i = 0; i < n; ++i) {
+            char *address = entries[order[i]].addr;
+            if(!address)
+                continue;
+            if(memory && memory->owns(address)) {
+                // giving a page or extent back may lock the Heap, and changes the Chunk list
+                // under the hint
+                if(heap)
+                    heap->unlock();
+                heap = nullptr;
+                memory->reclaim(address, entries[order[i]].size);
+                continue;
+            }
+            if(!heap || !heap->contains(address)) {
+                if(heap)
+                    heap->unlock();
+                hint = nullptr;
+                if(!(heap = memory ? memory->heap_table.find(address) : find(address))) {
+                    /// \bug should oops about bad free address (AN_BadFreeAddr)
+                    continue;
+                }
+                heap->lock();
+            }
+            hint = heap->release(hint, address, entries[order[i]].size);
+        }
+        if(heap)
+            heap->unlock();
+    }
+
+    if(bytes)
+        deallocate(reinterpret_cast<char *>(order), bytes);
+}
+
+/** Releases every MemEntry on a list, as is done when a Task exits.
+    \param mementries the list, which will become empty
+    \param memory the MemoryState that they were allocated through, or nullptr
+*/
+void HeapList::deallocate_multiple(MemEntryList *mementries, MemoryState *memory) {
+    while(MemEntry *me = mementries->shift())
+        deallocate_multiple(me, memory);
+}
+
 MemEntry *HeapList::allocate_mementry(size_t count) {
     // a bit icky, should probably do sizeof()
     size_t bytes = 2 + count * 4;
@@ -602,3 +2232,1376 @@ void HeapList::deallocate_mementry(MemEntry *me) {
         deallocate(reinterpret_cast<char *>(me), bytes);
     }
 }
+
+// -------------------- MemHandlerList --------------------
+
+/** constructor. */
+MemHandlerList::MemHandlerList(void)
+    : ListOf<Interrupt>(Node::NT_INTERRUPT)
+{}
+
+/** Adds a low-memory handler [AmigaOS AddMemHandler()].
+    \param handler the handler, which is called in priority order
+*/
+void MemHandlerList::add(Interrupt *handler) {
+    enqueue(handler);
+}
+
+/** Removes a low-memory handler [AmigaOS RemMemHandler()].
+    \param handler the handler, which must have been added with add()
+*/
+void MemHandlerList::remove(Interrupt *handler) {
+    ListOf<Interrupt>::remove(handler);
+}
+
+/** Calls a low-memory handler.
+    \param handler the handler
+    \param data what the handler is told about the failed allocation
+    \returns a value from MemHandlerList::Result
+*/
+int32_t MemHandlerList::call(Interrupt *handler, MemHandlerData *data) {
+#ifdef HOSTED_TEST
+    typedef int32_t (*Code)(MemHandlerData *, void *);
+    return reinterpret_cast<Code>(handler->code)(data, handler->data);
+#else
+    register MemHandlerData *in_a0 asm("%a0") = data;
+    register void *in_a1 asm("%a1") = handler->data;
+    register void (*in_a2)(void) asm("%a2") = handler->code;
+    register ExecBase * const in_a6 asm("%a6") = execbase;
+    register int32_t ret asm("%d0");
+    asm volatile("jsr (%3)" : "=r"(ret), "+r"(in_a0), "+r"(in_a1) : "r"(in_a2), "r"(in_a6)
+                 : "%d1", "memory");
+    return ret;
+#endif
+}
+
+/** Calls the low-memory handlers in turn after an allocation has failed, retrying the allocation
+    whenever one of them claims to have freed something. As on AmigaOS, the handlers are called in
+    Forbid(), which also stops the chain from changing underneath. A handler that returns
+    MEM_TRY_AGAIN is called again at most RETRIES times in a row.
+    \param heaps the HeapList to allocate from
+    \param size the number of bytes to allocate
+    \param attributes the attributes of the memory required
+    \param options the allocation options
+    \param selection how to choose the Heap
+    \returns pointer to the new memory, or nullptr if the handlers couldn't help
+*/
+char *MemHandlerList::relieve(HeapList *heaps, size_t size, Heap::Attributes attributes,
+                              Heap::Options options, HeapList::Selection selection) {
+    MemHandlerData data;
+    data.request_size = size;
+    data.request_flags = (uint32_t)attributes | (uint32_t)options << 16;
+    data.flags = 0;
+    char *mem = nullptr;
+#ifndef HOSTED_TEST
+    execbase->forbid();
+#endif
+    unsigned retries = 0;
+    for(iterator i = begin(), e = end(); i != e; ) {
+        int32_t result = call(*i, &data);
+        if(result != MEM_DID_NOTHING
+           && (mem = heaps->allocate(size, attributes, options, selection)))
+            break;
+        // it may be able to free some more, but a handler that never gives up mustn't keep us here
+        // for ever
+        if(result == MEM_TRY_AGAIN && ++retries <= RETRIES) {
+            data.flags |= MemHandlerData::MEMHF_RECYCLE;
+        } else {
+            data.flags &= ~MemHandlerData::MEMHF_RECYCLE;
+            retries = 0;
+            ++i;
+        }
+    }
+#ifndef HOSTED_TEST
+    execbase->Permit();
+#endif
+    return mem;
+}
+
+// -------------------- AllocTrace --------------------
+
+/** constructor. Tracing is off to begin with. */
+AllocTrace::AllocTrace(void) : log(nullptr) {}
+
+/** \returns the time, in horizontal lines since CIA B was last reset; or zero under test */
+uint32_t AllocTrace::clock(void) {
+#ifdef HOSTED_TEST
+    return 0;
+#else
+    amiga::CIA volatile * const ciab = reinterpret_cast<amiga::CIA *>(amiga::CIABBase);
+    // reading the high byte latches the counter until the low byte has been read
+    uint32_t high = ciab->todhi;
+    uint32_t mid = ciab->todmid;
+    return high << 16 | mid << 8 | ciab->todlow;
+#endif
+}
+
+/** Records a call. The parameters are as for record().
+    \param event what happened
+    \param size the size requested
+    \param requirements the requirements, as passed to AllocMem()
+    \param address the address returned or freed
+    \param caller the return address of the call
+*/
+void AllocTrace::append(Event event, size_t size, uint32_t requirements, const char *address,
+                        const void *caller) {
+    Record *record = &log->records[log->next];
+    record->event = event;
+    record->size = size;
+    record->requirements = requirements;
+    record->address = address;
+    record->caller = caller;
+    record->time = clock();
+    if(++log->next == log->capacity)
+        log->next = 0;
+    ++log->count;
+}
+
+/** Records every entry of an AllocEntry() or FreeEntry(). The parameters are as for record().
+    \param event what happened
+    \param requests the MemEntry that was asked for, or nullptr if the requirements are unknown
+    \param entries the MemEntry that was allocated or freed
+    \param caller the return address of the call
+*/
+void AllocTrace::append(Event event, const MemEntry *requests, const MemEntry *entries,
+                        const void *caller) {
+    for(size_t i = 0; i < entries->count; ++i) {
+        const MemEntry::Entry *entry = &entries->entries[i];
+        uint32_t requirements = requests
+            ? (uint32_t)requests->entries[i].attributes | (uint32_t)requests->entries[i].options << 16
+            : 0;
+        append(event, entry->size, requirements, entry->addr, caller);
+    }
+}
+
+/** Starts or stops tracing [Openkick SetAllocTrace()].
+    \param log_ the Log to record into, whose capacity must be set; or nullptr to stop
+    \returns the Log that was being recorded into, or nullptr if tracing was off
+*/
+AllocTrace::Log *AllocTrace::start(Log *log_) {
+    Log *old = log;
+    if(log_ && !log_->capacity)
+        log_ = nullptr;
+    if(log_)
+        log_->next = log_->count = 0;
+    log = log_;
+    return old;
+}
+
+// -------------------- AllocProfile --------------------
+
+/** constructor. Profiling is off to begin with.
+    \param heaps_ where to allocate the table from
+*/
+AllocProfile::AllocProfile(HeapList *heaps_)
+    : heaps(heaps_), sites(nullptr), period(0), countdown(0), dropped(0), mode(SAMPLE_CALLS)
+{}
+
+/** Counts down to the next sample, and takes it if it's due.
+    \param size the size allocated or freed
+    \param caller the return address of the call
+    \param freeing true for a free, false for an allocation
+*/
+void AllocProfile::tick(size_t size, const void *caller, bool freeing) {
+    countdown -= mode == SAMPLE_BYTES ? size : 1;
+    if(countdown > 0)
+        return;
+    // a large allocation may span several periods, but it's still only one sample
+    countdown += period;
+    if(countdown <= 0)
+        countdown = period;
+
+    // the table is open-addressed, hashed on the caller's address
+    address_t key = reinterpret_cast<address_t>(caller) >> 1;
+    unsigned slot = (key ^ key >> 6 ^ key >> 12) % SITES;
+    for(unsigned probes = 0; probes < SITES; ++probes, slot = (slot + 1) % SITES) {
+        Site *site = &sites[slot];
+        if(!site->caller)
+            site->caller = caller;
+        else if(site->caller != caller)
+            continue;
+        if(freeing) {
+            ++site->frees;
+        } else {
+            ++site->allocations;
+            site->bytes += size;
+        }
+        return;
+    }
+    ++dropped;
+}
+
+/** Starts, restarts or stops profiling [Openkick SetAllocProfile()]. Restarting clears the table.
+    \param period_ how many calls or bytes to leave between samples, or zero to stop
+    \param mode_ what \a period_ counts
+    \returns true on success, or false if there was no memory for the table
+*/
+bool AllocProfile::start(uint32_t period_, Mode mode_) {
+    const size_t size = sizeof(Site) * SITES;
+    if(!period_) {
+        if(sites)
+            heaps->deallocate(reinterpret_cast<char *>(sites), size);
+        sites = nullptr;
+        return true;
+    }
+    if(sites)
+        bzero(sites, size);
+    else if(!(sites = reinterpret_cast<Site *>(
+                  heaps->allocate(size, Heap::MEMF_PUBLIC, Heap::MEMF_CLEAR))))
+        return false;
+    period = period_;
+    countdown = period_;
+    dropped = 0;
+    mode = mode_;
+    return true;
+}
+
+// -------------------- HeapTable --------------------
+
+/** constructor. The table is built straight away.
+    \param heaps_ the HeapList whose heaps are to be tabulated
+*/
+HeapTable::HeapTable(HeapList *heaps_) : heaps(heaps_) {
+    rebuild();
+}
+
+/** Rebuilds the table from the HeapList. This needs to be done whenever a Heap is added. */
+void HeapTable::rebuild(void) {
+    count = group_count = unindexed = 0;
+    overflowed = false;
+    for(HeapList::iterator i = heaps->begin(); i != heaps->end(); ++i) {
+        Heap *heap = *i;
+        Heap::Index *index = heap->index();
+        if(count == CAPACITY) {
+            // this Heap can't be in a group, so it mustn't update one
+            if(index)
+                index->tally = nullptr;
+            overflowed = true;
+            continue;
+        }
+        // insertion sort, as there are never many heaps
+        uint16_t n = count++;
+        for(; n && entries[n - 1].lower > heap->lower; --n)
+            entries[n] = entries[n - 1];
+        entries[n].lower = heap->lower;
+        entries[n].upper = heap->upper;
+        entries[n].heap = heap;
+
+        Group *group = groups;
+        while(group < groups + group_count && group->attributes != heap->attributes)
+            ++group;
+        if(group == groups + group_count) {
+            ++group_count;
+            group->attributes = heap->attributes;
+            group->free = group->size = 0;
+        }
+        group->size += heap->upper - heap->lower;
+        if(index) {
+            index->tally = &group->free;
+            group->free += heap->free;
+        } else {
+            ++unindexed;
+        }
+    }
+}
+
+/** Finds the Heap that contains an address.
+    \param address the address
+    \returns the Heap, or nullptr if the address is not in any of them
+    \sa HeapList::find
+*/
+Heap *HeapTable::find(const char *address) const {
+    // find the last entry that starts at or before the address
+    uint16_t low = 0, high = count;
+    while(low < high) {
+        uint16_t middle = (low + high) / 2;
+        if(entries[middle].lower <= address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if(low && address < entries[low - 1].upper)
+        return entries[low - 1].heap;
+    return overflowed ? heaps->find(address) : nullptr;
+}
+
+/** Allocate memory at a specific address, as HeapList::allocate_at() does.
+    This is the underlying implementation for exec.library/AllocAbs().
+    \param address the address to allocate at
+    \param size the number of bytes to allocate
+    \returns pointer to the new memory, or nullptr if the allocation failed
+*/
+char *HeapTable::allocate_at(char *address, size_t size) {
+    Heap *heap = find(address);
+    if(!heap)
+        return nullptr;
+    heap->lock();
+    char *mem = heap->allocate_at(address, size);
+    heap->unlock();
+    return mem;
+}
+
+/** Release memory, as HeapList::deallocate() does.
+    This is the underlying implementation of exec.library/FreeMem().
+    \param address the memory previously allocated
+    \param size the number of bytes previously allocated
+*/
+void HeapTable::deallocate(char *address, size_t size) {
+    if(Heap *heap = find(address)) {
+        heap->lock();
+        heap->deallocate(address, size);
+        heap->unlock();
+        return;
+    }
+    /// \bug should oops about bad free address (AN_BadFreeAddr)
+}
+
+/** Reports memory attributes for a given address, as HeapList::type() does.
+    This is the underlying implementation of exec.library/TypeOfMem().
+    \param address the pointer to check
+    \returns the memory's attributes
+*/
+Heap::Attributes HeapTable::type(const char *address) const {
+    const Heap *heap = find(address);
+    // classic AmigaOS returns zero.
+    return heap ? heap->attributes : Heap::MEMF_ANY;
+}
+
+/** Reports the amount of free memory, as HeapList::available() does, but from the running totals.
+    This is the underlying implementation of exec.library/AvailMem().
+    \param attributes the attributes of the memory to check
+    \param options MEMF_TOTAL for the total size rather than the free memory, or MEMF_LARGEST for
+    the largest free chunk
+    \returns the amount of memory matching the description
+*/
+size_t HeapTable::available(Heap::Attributes attributes, Heap::Options options) const {
+    // the largest chunk can't be kept as a running total, and nor can heaps that aren't in the table
+    if(overflowed || ((unsigned)options & (unsigned)Heap::MEMF_LARGEST))
+        return heaps->available(attributes, options);
+
+    size_t size = 0;
+    for(const Group *group = groups; group < groups + group_count; ++group)
+        if(((unsigned)group->attributes & (unsigned)attributes) == (unsigned)attributes)
+            size += (unsigned)options & (unsigned)Heap::MEMF_TOTAL ? group->size : group->free;
+
+    if(unindexed && !((unsigned)options & (unsigned)Heap::MEMF_TOTAL))
+        for(const Entry *entry = entries; entry < entries + count; ++entry)
+            if(!entry->heap->index() && entry->heap->provides(attributes))
+                size += entry->heap->free;
+    return size;
+}
+
+/** Reports free Chip RAM, free Fast RAM, all free memory and the largest free chunk in one go, for
+    things that poll them all.
+    \param summary receives the results
+*/
+void HeapTable::summarise(Summary *summary) const {
+    summary->chip = available(Heap::MEMF_CHIP);
+    summary->fast = available(Heap::MEMF_FAST);
+    summary->total = available(Heap::MEMF_ANY);
+    summary->largest = heaps->available(Heap::MEMF_ANY, Heap::MEMF_LARGEST);
+}
+
+// -------------------- Pool --------------------
+
+/** header of an allocation from a Pool that was too large for a puddle */
+class exec::Pool::Block : public MinNode {
+public:
+    uint32_t size;              //!< size of the Block, including this header, in bytes
+};
+
+/** constructor.
+    \param heaps_ the HeapList to take memory from
+    \param attributes_ the attributes of the memory in the pool
+    \param options_ the options to use for each allocation, e.g. MEMF_CLEAR
+    \param puddle_size_ the size of each puddle, in bytes
+    \param threshold_ the largest allocation to make from a puddle
+*/
+Pool::Pool(HeapList *heaps_, Heap::Attributes attributes_, Heap::Options options_,
+           size_t puddle_size_, size_t threshold_)
+    : heaps(heaps_), puddles(Node::NT_MEMORY), blocks(), attributes(attributes_),
+      options(options_), threshold(threshold_)
+{
+    // leave room for the puddle's Heap, and for an Index if it's large enough to get one, so that
+    // a fresh puddle can always satisfy an allocation of up to the threshold
+    puddle_size = sizeof(Heap) + ((puddle_size_ + 7) & ~7);
+    if(puddle_size >= Heap::Index::MINIMUM_SIZE)
+        puddle_size += sizeof(Heap::Index) + 3 * Heap::Index::GRANULE;
+}
+
+/** Creates a new memory pool.
+
+    This is the underlying implementation of exec.library/CreatePool().
+
+    \param heaps the HeapList to take memory from
+    \param attributes the attributes of the memory in the pool
+    \param options the options to use for each allocation; only MEMF_CLEAR is meaningful
+    \param puddle_size the size of each puddle, in bytes
+    \param threshold the largest allocation to make from a puddle; anything larger gets memory of its
+    own. This may not exceed \a puddle_size.
+    \returns the new Pool, or nullptr if it could not be created
+*/
+Pool *Pool::create(HeapList *heaps, Heap::Attributes attributes, Heap::Options options,
+                   size_t puddle_size, size_t threshold) {
+    if(!puddle_size || threshold > puddle_size)
+        return nullptr;
+    char *memory = heaps->allocate(sizeof(Pool), attributes);
+    if(!memory)
+        return nullptr;
+    return new (memory) Pool(heaps, attributes, options, puddle_size, threshold);
+}
+
+/** Releases a memory pool, and all memory allocated from it, in one go.
+
+    This is the underlying implementation of exec.library/DeletePool(). The Pool is invalid
+    afterwards.
+*/
+void Pool::destroy(void) {
+    while(Heap *puddle = puddles.shift())
+        heaps->deallocate(reinterpret_cast<char *>(puddle), puddle_size);
+    while(Block *block = static_cast<Block *>(blocks.shift()))
+        heaps->deallocate(reinterpret_cast<char *>(block), block->size);
+    heaps->deallocate(reinterpret_cast<char *>(this), sizeof(Pool));
+}
+
+/** Adds a new, empty puddle to the pool.
+    \returns the puddle's Heap, or nullptr if there was no memory for it
+*/
+Heap *Pool::add_puddle(void) {
+    char *memory = heaps->allocate(puddle_size, attributes);
+    if(!memory)
+        return nullptr;
+    Heap *puddle = Heap::create(puddle_size, attributes, 0, memory, "pool");
+    puddles.unshift(puddle);
+    return puddle;
+}
+
+/** Allocates memory from the pool.
+
+    This is the underlying implementation of exec.library/AllocPooled(). Allocations up to the
+    threshold are made from the first puddle with room, and a new puddle is added if none has.
+    Larger allocations get memory of their own directly from the HeapList.
+
+    \param size the number of bytes to allocate
+    \returns pointer to the new memory, or nullptr if the allocation failed
+*/
+char *Pool::allocate(size_t size) {
+    if(!size)
+        return nullptr;
+
+    char *memory = nullptr;
+    if(size > threshold) {
+        Block *block = reinterpret_cast<Block *>(heaps->allocate(sizeof(Block) + size, attributes));
+        if(!block)
+            return nullptr;
+        block->size = sizeof(Block) + size;
+        blocks.push(block);
+        memory = reinterpret_cast<char *>(block + 1);
+    } else {
+        for(ListOf<Heap>::iterator i = puddles.begin(); !memory && i != puddles.end(); ++i)
+            memory = (*i)->allocate(size);
+        if(!memory) {
+            Heap *puddle = add_puddle();
+            if(!puddle)
+                return nullptr;
+            memory = puddle->allocate(size);
+        }
+    }
+
+    if(memory && ((unsigned)options & (unsigned)Heap::MEMF_CLEAR))
+        bzero(memory, size);
+    return memory;
+}
+
+/** Releases memory back to the pool.
+
+    This is the underlying implementation of exec.library/FreePooled(). Memory in a puddle stays with
+    the pool until it is destroyed.
+
+    \param memory the memory previously allocated
+    \param size the number of bytes previously allocated
+*/
+void Pool::deallocate(char *memory, size_t size) {
+    if(size > threshold) {
+        Block *block = reinterpret_cast<Block *>(memory) - 1;
+        MinList::remove(block);
+        heaps->deallocate(reinterpret_cast<char *>(block), block->size);
+        return;
+    }
+    for(ListOf<Heap>::iterator i = puddles.begin(); i != puddles.end(); ++i) {
+        if((*i)->contains(memory))
+            return (*i)->deallocate(memory, size);
+    }
+    /// \bug should oops about bad free address (AN_BadFreeAddr)
+}
+
+// -------------------- ObjectCache --------------------
+
+/** header at the start of each slab of an ObjectCache */
+class exec::ObjectCache::Slab : public MinNode {
+public:
+    ObjectCache *cache;         //!< the cache that this slab belongs to
+    char *free;                 //!< the first free object, which points to the next, and so on
+    uint16_t used;              //!< the number of objects in use
+};
+
+/** constructor.
+    \param heaps_ the HeapList to take slabs from
+    \param size_ the size of the objects to cache
+*/
+ObjectCache::ObjectCache(HeapList *heaps_, size_t size_)
+    : heaps(heaps_), slabs(), unused(0), hits(0), misses(0)
+{
+    // a free object holds the pointer to the next one, so it must be big enough and aligned for that
+    size = (size_ + sizeof(char *) - 1) & ~(sizeof(char *) - 1);
+    count = (SLAB_SIZE - sizeof(Slab)) / size;
+}
+
+/** Obtains a new slab and puts all of its objects on its free list.
+
+    Slabs are aligned to their size so that the slab of an object can be found by masking its
+    address.
+
+    \returns the new slab, or nullptr if there was no memory for it
+*/
+ObjectCache::Slab *ObjectCache::add_slab(void) {
+    char *base = heaps->allocate_aligned(SLAB_SIZE, SLAB_SIZE);
+    if(!base)
+        return nullptr;
+
+    Slab *slab = new (base) Slab();
+    slab->cache = this;
+    slab->used = 0;
+    slab->free = nullptr;
+    // the objects are packed against the top of the slab, which keeps them aligned, and threaded
+    // onto the free list backwards so that they're handed out in address order
+    char *object = base + SLAB_SIZE - size;
+    for(uint16_t i = 0; i < count; ++i, object -= size) {
+        *reinterpret_cast<char **>(object) = slab->free;
+        slab->free = object;
+    }
+    slabs.unshift(slab);
+    ++unused;
+    return slab;
+}
+
+/** Allocates an object.
+    \param size_ the size of the object; anything larger than the cache's objects is allocated
+    from the HeapList instead
+    \returns the object, or nullptr if there was no memory for it
+*/
+char *ObjectCache::allocate(size_t size_) {
+    if(size_ > size) {
+        ++misses;
+        return heaps->allocate(size_);
+    }
+
+    Slab *slab;
+    if(slabs.isempty()) {
+        ++misses;
+        slab = add_slab();
+        if(!slab)
+            return nullptr;
+    } else {
+        ++hits;
+        slab = static_cast<Slab *>(*slabs.begin());
+    }
+
+    if(!slab->used++)
+        --unused;
+    char *object = slab->free;
+    slab->free = *reinterpret_cast<char **>(object);
+    // a full slab is taken off the list until one of its objects is freed
+    if(!slab->free)
+        MinList::remove(slab);
+    return object;
+}
+
+/** Releases an object. A slab that becomes unused is given back to the HeapList, unless it is the
+    only unused one, which is kept to avoid thrashing.
+    \param object the object
+    \param size_ the size that was passed to allocate()
+*/
+void ObjectCache::deallocate(char *object, size_t size_) {
+    if(!object)
+        return;
+    if(size_ > size)
+        return heaps->deallocate(object, size_);
+
+    Slab *slab = reinterpret_cast<Slab *>(
+        reinterpret_cast<address_t>(object) & ~address_t(SLAB_SIZE - 1)
+      );
+    if(slab->cache != this) {
+        /// \bug should oops about bad free address (AN_BadFreeAddr)
+        return;
+    }
+
+    if(!slab->free)
+        slabs.unshift(slab);
+    *reinterpret_cast<char **>(object) = slab->free;
+    slab->free = object;
+
+    if(!--slab->used) {
+        MinList::remove(slab);
+        if(unused) {
+            heaps->deallocate(reinterpret_cast<char *>(slab), SLAB_SIZE);
+        } else {
+            ++unused;
+            slabs.push(slab);
+        }
+    }
+}
+
+// -------------------- SizeClasses --------------------
+
+/** the object sizes of each size class; the classes are spaced more widely as they get larger so
+    that little is lost to rounding */
+static const uint8_t CLASS_SIZES[SizeClasses::CLASS_COUNT] = { 8, 16, 24, 32, 48, 64, 96, 128 };
+
+/** a group of pages obtained from a HeapList in one go, with its page→class map */
+class exec::SizeClasses::Arena {
+public:
+    enum : uint8_t {
+        UNUSED = 0xff,          //!< the class of a page that holds no objects
+    };
+    AVLNode node;                       //!< node in the tree of arenas, by address
+    uint8_t classes[ARENA_PAGES];       //!< the size class of each page, or UNUSED
+    uint8_t used[ARENA_PAGES];          //!< the number of objects in use in each page
+    char *free[ARENA_PAGES];            //!< the first free object in each page, which points to the next
+
+    /** \returns the size of the arena's header, which keeps the pages aligned for any object */
+    static size_t header_size(void) { return (sizeof(Arena) + 15) & ~size_t(15); }
+    /** \returns the size of the memory obtained for an arena */
+    static size_t total_size(void) { return header_size() + ARENA_PAGES * PAGE_SIZE; }
+    /** \returns the address of a page
+        \param n the number of the page */
+    char *page(unsigned n) { return reinterpret_cast<char *>(this) + header_size() + n * PAGE_SIZE; }
+    /** get the arena that a tree node belongs to
+        \param node the node, or nullptr \returns its arena, or nullptr */
+    static Arena *arena_of(const AVLNode *node) {
+        return reinterpret_cast<Arena *>(const_cast<AVLNode *>(node));
+    }
+    static int32_t compare(const AVLNode *, const AVLNode *);
+    static int32_t compare_key(const AVLNode *, const void *);
+    void format(unsigned, unsigned);
+};
+
+/** Orders two arenas by address. */
+int32_t SizeClasses::Arena::compare(const AVLNode *left, const AVLNode *right) {
+    return left < right ? -1 : left > right;
+}
+
+/** Orders an arena against an address. */
+int32_t SizeClasses::Arena::compare_key(const AVLNode *node, const void *key) {
+    return node < key ? -1 : node > key;
+}
+
+/** Divides a page into objects of a size class and puts them all on its free list.
+    \param n the number of the page
+    \param c the size class
+*/
+void SizeClasses::Arena::format(unsigned n, unsigned c) {
+    size_t size = CLASS_SIZES[c];
+    char *base = page(n);
+    classes[n] = c;
+    used[n] = 0;
+    free[n] = nullptr;
+    // thread the objects backwards so that they're handed out in address order
+    for(size_t i = PAGE_SIZE / size; i--; ) {
+        char *object = base + i * size;
+        *reinterpret_cast<char **>(object) = free[n];
+        free[n] = object;
+    }
+}
+
+/** constructor.
+    \param heaps_ the HeapList to take arenas from
+*/
+SizeClasses::SizeClasses(HeapList *heaps_) : heaps(heaps_), arenas(nullptr) {
+    for(unsigned c = 0; c < CLASS_COUNT; ++c) {
+        current[c] = nullptr;
+        page[c] = 0;
+    }
+}
+
+/** Obtains a new arena with all of its pages unused.
+    \returns the arena, or nullptr if there was no memory for it
+*/
+SizeClasses::Arena *SizeClasses::add_arena(void) {
+    Arena *arena = reinterpret_cast<Arena *>(heaps->allocate(Arena::total_size()));
+    if(!arena)
+        return nullptr;
+    for(unsigned n = 0; n < ARENA_PAGES; ++n)
+        arena->classes[n] = Arena::UNUSED;
+    AVLNode::add(&arenas, &arena->node, Arena::compare);
+    return arena;
+}
+
+/** Finds a page with free objects for a size class and makes it the class's current page. Pages
+    that are already in the class are preferred, then unused pages, and only then a new arena.
+    \param c the size class
+    \returns the arena of the page, or nullptr if there was no memory for a new arena
+*/
+SizeClasses::Arena *SizeClasses::find_page(unsigned c) {
+    Arena *spare = nullptr;
+    unsigned spare_page = 0;
+    for(const AVLNode *node = AVLNode::first(arenas); node; node = node->next()) {
+        Arena *arena = Arena::arena_of(node);
+        for(unsigned n = 0; n < ARENA_PAGES; ++n) {
+            if(arena->classes[n] == c && arena->free[n]) {
+                current[c] = arena;
+                page[c] = n;
+                return arena;
+            }
+            if(!spare && arena->classes[n] == Arena::UNUSED) {
+                spare = arena;
+                spare_page = n;
+            }
+        }
+    }
+
+    if(!spare && !(spare = add_arena()))
+        return nullptr;
+    spare->format(spare_page, c);
+    current[c] = spare;
+    page[c] = spare_page;
+    return spare;
+}
+
+/** Allocates a small object.
+    \param size the size of the object
+    \returns the object, or nullptr if it is larger than LARGEST or there was no memory for it
+*/
+char *SizeClasses::allocate(size_t size) {
+    if(size > LARGEST)
+        return nullptr;
+    unsigned c = 0;
+    while(CLASS_SIZES[c] < size)
+        ++c;
+
+    Arena *arena = current[c];
+    if((!arena || !arena->free[page[c]]) && !(arena = find_page(c)))
+        return nullptr;
+    unsigned n = page[c];
+    char *object = arena->free[n];
+    arena->free[n] = *reinterpret_cast<char **>(object);
+    ++arena->used[n];
+    return object;
+}
+
+/** Releases a small object. A page that becomes unused is made available to every size class,
+    unless it is the current page of its own, and an arena whose pages are all unused is given back
+    to the HeapList, unless it is the only one.
+    \param object the object
+    \returns false if \a object does not belong to any arena, in which case nothing is done
+*/
+bool SizeClasses::deallocate(char *object) {
+    // the arena that would hold it is the last one that starts below it
+    Arena *arena = Arena::arena_of(AVLNode::find_prev(arenas, object, Arena::compare_key));
+    if(!arena || object < arena->page(0) || object >= arena->page(ARENA_PAGES))
+        return false;
+
+    unsigned n = (object - arena->page(0)) / PAGE_SIZE;
+    unsigned c = arena->classes[n];
+    if(c == Arena::UNUSED) {
+        /// \bug should oops about bad free address (AN_BadFreeAddr)
+        return true;
+    }
+    *reinterpret_cast<char **>(object) = arena->free[n];
+    arena->free[n] = object;
+    if(--arena->used[n] || (current[c] == arena && page[c] == n))
+        return true;
+
+    arena->classes[n] = Arena::UNUSED;
+    for(n = 0; n < ARENA_PAGES; ++n)
+        if(arena->classes[n] != Arena::UNUSED)
+            return true;
+    if(AVLNode::first(arenas) != AVLNode::last(arenas)) {
+        AVLNode::remove(&arenas, &arena->node);
+        heaps->deallocate(reinterpret_cast<char *>(arena), Arena::total_size());
+    }
+    return true;
+}
+
+// -------------------- ChipPages --------------------
+
+/** a page of Chip RAM, with a bitmap of the granules that are in use */
+class exec::ChipPages::Page {
+public:
+    Page *next;                 //!< the next page, or nullptr if this is the last one
+    uint16_t free;              //!< the number of granules not in use
+    uint32_t bitmap[WORDS];     //!< bit g%32 of bitmap[g/32] is set if granule g is in use
+
+    /** \returns the size of the page's header, which keeps the granules aligned */
+    static size_t header_size(void) { return (sizeof(Page) + GRANULE - 1) & ~size_t(GRANULE - 1); }
+    /** \returns the size of the memory obtained for a page */
+    static size_t total_size(void) { return header_size() + PAGE_SIZE; }
+    /** \returns the address of a granule
+        \param g the number of the granule */
+    char *granule(unsigned g) { return reinterpret_cast<char *>(this) + header_size() + g * GRANULE; }
+    /** \returns the address of a granule
+        \param g the number of the granule */
+    const char *granule(unsigned g) const {
+        return reinterpret_cast<const char *>(this) + header_size() + g * GRANULE;
+    }
+    unsigned find(unsigned) const;
+    void mark(unsigned, unsigned, bool);
+};
+
+/** Finds a run of free granules, a longword of the bitmap at a time.
+    \param n the number of granules, which must be at most 32
+    \returns the first granule of the run, or GRANULES if there is none
+*/
+unsigned ChipPages::Page::find(unsigned n) const {
+    unsigned run = 0, start = 0;    // the free run so far, which may carry on from longword to longword
+    for(unsigned w = 0; w < WORDS; ++w) {
+        uint32_t used = bitmap[w];
+        if(used == ~uint32_t(0)) {
+            run = 0;
+            continue;
+        }
+        if(!used) {
+            if(!run)
+                start = w * 32;
+            run += 32;
+            if(run >= n)
+                return start;
+            continue;
+        }
+        // a new run can only start at the first free granule
+        for(unsigned b = run ? 0 : lowest_bit(~used); b < 32; ++b) {
+            if(used & uint32_t(1) << b) {
+                run = 0;
+                continue;
+            }
+            if(!run++)
+                start = w * 32 + b;
+            if(run >= n)
+                return start;
+        }
+    }
+    return GRANULES;
+}
+
+/** Marks a run of granules as in use or free.
+    \param g the first granule
+    \param n the number of granules, which must be at most 32
+    \param used whether they are now in use
+*/
+void ChipPages::Page::mark(unsigned g, unsigned n, bool used) {
+    if(used)
+        free -= n;
+    else
+        free += n;
+    while(n) {
+        unsigned b = g % 32, k = min(n, 32 - b);
+        uint32_t mask = (k == 32 ? ~uint32_t(0) : (uint32_t(1) << k) - 1) << b;
+        if(used)
+            bitmap[g / 32] |= mask;
+        else
+            bitmap[g / 32] &= ~mask;
+        g += k;
+        n -= k;
+    }
+}
+
+/** constructor.
+    \param heaps_ the HeapList to take pages from
+*/
+ChipPages::ChipPages(HeapList *heaps_) : heaps(heaps_), pages(nullptr), lower(nullptr), upper(nullptr) {}
+
+/** Obtains a new page with all of its granules free, from the top of Chip RAM.
+    \returns the page, or nullptr if there was no memory for it
+*/
+ChipPages::Page *ChipPages::add_page(void) {
+    Page *page = reinterpret_cast<Page *>(
+        heaps->allocate(Page::total_size(), Heap::MEMF_CHIP, Heap::MEMF_REVERSE));
+    if(!page)
+        return nullptr;
+    page->free = GRANULES;
+    for(unsigned w = 0; w < WORDS; ++w)
+        page->bitmap[w] = 0;
+    // keep the pages in descending order of address, so that allocations are packed into the
+    // highest ones and the lowest ones empty out and are given back
+    Page **ppage = &pages;
+    while(*ppage && *ppage > page)
+        ppage = &(*ppage)->next;
+    page->next = *ppage;
+    *ppage = page;
+    if(!lower || page->granule(0) < lower)
+        lower = page->granule(0);
+    if(page->granule(GRANULES) > upper)
+        upper = page->granule(GRANULES);
+    return page;
+}
+
+/** Works out the range of addresses that the pages cover, after one has been given back. */
+void ChipPages::find_bounds(void) {
+    lower = upper = nullptr;
+    for(Page *page = pages; page; page = page->next) {
+        if(!lower || page->granule(0) < lower)
+            lower = page->granule(0);
+        if(page->granule(GRANULES) > upper)
+            upper = page->granule(GRANULES);
+    }
+}
+
+/** Allocates small Chip RAM memory from a page.
+    \param size the number of bytes to allocate
+    \param attributes the attributes of the memory required
+    \param options the allocation options
+    \returns pointer to the new memory, or nullptr if the request isn't for at most LARGEST bytes
+    of Chip RAM, or there was no memory for a new page
+*/
+char *ChipPages::allocate(size_t size, Heap::Attributes attributes, Heap::Options options) {
+    if(!size || size > LARGEST || !((unsigned)attributes & (unsigned)Heap::MEMF_CHIP)
+       || ((unsigned)attributes & ~((unsigned)Heap::MEMF_CHIP | (unsigned)Heap::MEMF_PUBLIC))
+       || ((unsigned)options & ~((unsigned)Heap::MEMF_CLEAR | (unsigned)Heap::MEMF_NO_EXPUNGE)))
+        return nullptr;
+
+    unsigned n = (size + GRANULE - 1) / GRANULE;
+    Page *page;
+    unsigned g = GRANULES;
+    for(page = pages; page; page = page->next)
+        if(page->free >= n && (g = page->find(n)) < GRANULES)
+            break;
+    if(!page) {
+        if(!(page = add_page()))
+            return nullptr;
+        g = 0;
+    }
+    page->mark(g, n, true);
+    char *memory = page->granule(g);
+    if((unsigned)options & (unsigned)Heap::MEMF_CLEAR)
+        bzero(memory, n * GRANULE);
+    return memory;
+}
+
+/** Releases memory that was allocated from a page. A page that becomes unused is given back to the
+    HeapList, unless it is the only one.
+    \param memory the memory
+    \param size the number of bytes allocated
+    \returns false if \a memory does not belong to any page, in which case nothing is done
+*/
+bool ChipPages::deallocate(char *memory, size_t size) {
+    if(memory < lower || memory >= upper || !size || size > LARGEST)
+        return false;
+    for(Page **ppage = &pages, *page; (page = *ppage); ppage = &page->next) {
+        if(memory < page->granule(0) || memory >= page->granule(GRANULES))
+            continue;
+
+        unsigned g = (memory - page->granule(0)) / GRANULE;
+        if(page->granule(g) != memory || !(page->bitmap[g / 32] & uint32_t(1) << g % 32)) {
+            /// \bug should oops about bad free address (AN_BadFreeAddr)
+            return true;
+        }
+        page->mark(g, (size + GRANULE - 1) / GRANULE, false);
+        if(page->free < GRANULES || (page == pages && !page->next))
+            return true;
+
+        *ppage = page->next;
+        heaps->deallocate(reinterpret_cast<char *>(page), Page::total_size());
+        find_bounds();
+        return true;
+    }
+    return false;
+}
+
+/** Finds whether an address is in a page.
+    \param address the address
+    \returns true if it is
+*/
+bool ChipPages::contains(const char *address) const {
+    if(address < lower || address >= upper)
+        return false;
+    for(const Page *page = pages; page; page = page->next)
+        if(address >= page->granule(0) && address < page->granule(GRANULES))
+            return true;
+    return false;
+}
+
+// -------------------- LargeObjects --------------------
+
+/** constructor.
+    \param heaps_ the HeapList to take extents from
+*/
+LargeObjects::LargeObjects(HeapList *heaps_) : heaps(heaps_), threshold(DEFAULT_THRESHOLD), count(0) {}
+
+/** Finds where an address falls in the map.
+    \param address the address
+    \returns the number of extents that start at or below \a address
+*/
+unsigned LargeObjects::search(const char *address) const {
+    unsigned low = 0, high = count;
+    while(low < high) {
+        unsigned middle = (low + high) / 2;
+        if(extents[middle].address <= address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/** Adds an extent that is in use to the map, which must have room for it.
+    \param i where it goes in the map
+    \param address the first page
+    \param size the size of the extent
+    \param heap the Heap that it was taken from
+*/
+void LargeObjects::insert(unsigned i, char *address, uint32_t size, Heap *heap) {
+    for(unsigned j = count++; j > i; --j)
+        extents[j] = extents[j - 1];
+    extents[i].address = address;
+    extents[i].size = size;
+    extents[i].heap = heap;
+    extents[i].used = true;
+}
+
+/** Removes an extent from the map.
+    \param i the extent
+*/
+void LargeObjects::remove(unsigned i) {
+    for(--count; i < count; ++i)
+        extents[i] = extents[i + 1];
+}
+
+/** Gives a free extent back to its Heap, and removes it from the map.
+    \param i the extent
+*/
+void LargeObjects::hand_back(unsigned i) {
+    // it comes off the map first, as waiting for the Heap's lock may let another task at the map
+    Extent extent = extents[i];
+    remove(i);
+    extent.heap->lock();
+    extent.heap->deallocate(extent.address, extent.size);
+    extent.heap->unlock();
+}
+
+/** Gives free extents back to their Heap from the top of the extents in it down, until one that
+    is in use is reached, so that the extents kept free are always between extents in use.
+    \param i the extent to start with
+*/
+void LargeObjects::give_back(unsigned i) {
+    while(!extents[i].used && (i + 1 == count || extents[i + 1].heap != extents[i].heap)) {
+        hand_back(i);
+        if(!i--)
+            return;
+    }
+}
+
+/** Takes a new extent from the bottom of the first Heap in priority order with room for it, and
+    adds it to the map, which must have room for it.
+    \param size the size of the extent
+    \param attributes the attributes of the memory required
+    \returns the extent, or nullptr if there was no memory for it
+*/
+char *LargeObjects::add_extent(uint32_t size, Heap::Attributes attributes) {
+    for(HeapList::iterator i = heaps->begin(), e = heaps->end(); i != e; ++i) {
+        Heap *heap = *i;
+        if(!heap->provides(attributes))
+            continue;
+        heap->lock();
+        char *address = heap->allocate_low(size, PAGE_SIZE);
+        heap->unlock();
+        if(address) {
+            insert(search(address), address, size, heap);
+            return address;
+        }
+    }
+    return nullptr;
+}
+
+/** Sets the size from which allocations are served from extents [Openkick SetLargeThreshold()].
+    Extents that are already allocated aren't affected.
+    \param threshold_ the smallest allocation to serve from an extent, or 0 to stop using them, in
+    which case the free extents are given back
+    \returns the previous threshold
+*/
+uint32_t LargeObjects::set_threshold(uint32_t threshold_) {
+    uint32_t old = threshold;
+    threshold = threshold_;
+    if(!threshold)
+        release();
+    return old;
+}
+
+/** Allocates memory from an extent. The free extent that fits most tightly is used, and if there
+    isn't one, a new extent is taken from a Heap.
+    \param size the number of bytes to allocate
+    \param attributes the attributes of the memory required
+    \param options the allocation options
+    \returns pointer to the new memory, or nullptr if the request is below the threshold, or there
+    was no memory or no room in the map for it. MEMF_REVERSE requests are refused too, as extents
+    are taken from the bottom of a Heap, and are left for the HeapList to take from the top.
+*/
+char *LargeObjects::allocate(size_t size, Heap::Attributes attributes, Heap::Options options) {
+    if(!is_large(size) || ((unsigned)options & ~((unsigned)Heap::MEMF_CLEAR
+                                                 | (unsigned)Heap::MEMF_NO_EXPUNGE)))
+        return nullptr;
+
+    uint32_t pages = (size + PAGE_SIZE - 1) & ~uint32_t(PAGE_SIZE - 1);
+    unsigned best = count;
+    for(unsigned i = 0; i < count; ++i) {
+        const Extent &extent = extents[i];
+        if(!extent.used && extent.size >= pages && extent.heap->provides(attributes)
+           && (best == count || extent.size < extents[best].size))
+            best = i;
+    }
+
+    char *memory;
+    if(best < count && extents[best].size == pages) {
+        extents[best].used = true;
+        memory = extents[best].address;
+    } else if(count == EXTENT_COUNT) {
+        return nullptr;
+    } else if(best < count) {
+        // take the bottom of the extent, so that what's left is nearer the rest of the Heap
+        memory = extents[best].address;
+        insert(best, memory, pages, extents[best].heap);
+        extents[best + 1].address += pages;
+        extents[best + 1].size -= pages;
+        give_back(best + 1);
+    } else if(!(memory = add_extent(pages, attributes))
+              && !(release() && (memory = add_extent(pages, attributes)))) {
+        // the free extents may have been too small, but merge into something larger once given back
+        return nullptr;
+    }
+    if((unsigned)options & (unsigned)Heap::MEMF_CLEAR)
+        bzero(memory, size);
+    return memory;
+}
+
+/** Releases memory that was allocated from an extent. The extent is merged with any free
+    neighbours, and given back to its Heap if it is the highest one in it.
+    \param memory the memory
+    \param size the number of bytes allocated
+    \returns false if \a memory does not belong to any extent, in which case nothing is done
+*/
+bool LargeObjects::deallocate(char *memory, size_t size) {
+    unsigned i = search(memory);
+    if(!i || memory >= extents[i - 1].address + extents[i - 1].size)
+        return false;
+    Extent *extent = &extents[--i];
+    if(!extent->used || extent->address != memory
+       || extent->size != ((size + PAGE_SIZE - 1) & ~uint32_t(PAGE_SIZE - 1))) {
+        /// \bug should oops about bad free address (AN_BadFreeAddr); freeing part of an extent
+        /// isn't supported
+        return true;
+    }
+
+    extent->used = false;
+    if(i + 1 < count && !extents[i + 1].used && extents[i + 1].heap == extent->heap
+       && extent->address + extent->size == extents[i + 1].address) {
+        extent->size += extents[i + 1].size;
+        remove(i + 1);
+    }
+    if(i && !extents[i - 1].used && extents[i - 1].heap == extent->heap
+       && extents[i - 1].address + extents[i - 1].size == extent->address) {
+        extents[i - 1].size += extent->size;
+        remove(i--);
+    }
+    give_back(i);
+    return true;
+}
+
+/** Finds whether an address is in an extent, free or not.
+    \param address the address
+    \returns true if it is
+*/
+bool LargeObjects::contains(const char *address) const {
+    unsigned i = search(address);
+    return i && address < extents[i - 1].address + extents[i - 1].size;
+}
+
+/** Reports the amount of memory in free extents, which AvailMem() adds to what the HeapList has.
+    \param attributes the attributes of the memory to count
+    \param options MEMF_LARGEST or MEMF_TOTAL, if required
+    \returns the amount of memory matching the description; the total is always 0, as the extents
+    are counted in the total size of their Heaps already
+*/
+size_t LargeObjects::available(Heap::Attributes attributes, Heap::Options options) const {
+    size_t size = 0;
+    if((unsigned)options & (unsigned)Heap::MEMF_TOTAL)
+        return 0;
+    for(unsigned i = 0; i < count; ++i) {
+        const Extent &extent = extents[i];
+        if(extent.used || !extent.heap->provides(attributes))
+            continue;
+        if(!((unsigned)options & (unsigned)Heap::MEMF_LARGEST))
+            size += extent.size;
+        else if(is_large(extent.size) && extent.size > size)
+            // smaller extents are only used for allocations that are served from the Heap instead
+            size = extent.size;
+    }
+    return size;
+}
+
+/** Gives every free extent back to its Heap, such as when an allocation from the Heap has failed.
+    \returns true if anything was given back
+*/
+bool LargeObjects::release(void) {
+    bool released = false;
+    for(unsigned i = 0; i < count; ) {
+        if(extents[i].used) {
+            ++i;
+            continue;
+        }
+        hand_back(i);
+        released = true;
+    }
+    return released;
+}
+
+/** Gives the free extents that overlap some memory back to their Heaps, such as when AllocAbs()
+    wants that memory.
+    \param memory the start of the memory
+    \param size its size
+    \returns true if anything was given back
+*/
+bool LargeObjects::release(const char *memory, size_t size) {
+    bool released = false;
+    // only the extent that starts at or below the memory, and those that start inside it, overlap
+    unsigned i = search(memory);
+    if(i)
+        --i;
+    while(i < count && extents[i].address < memory + size) {
+        if(extents[i].used || extents[i].address + extents[i].size <= memory) {
+            ++i;
+            continue;
+        }
+        hand_back(i);
+        released = true;
+    }
+    return released;
+}
+
+// -------------------- MemoryState --------------------
+
+/** constructor.
+    \param heaps_ the system HeapList, which everything else is taken from
+    \param task_size the size of a Task
+    \param message_size the size of a Message
+    \param iorequest_size the size of an IORequest
+    \param builder_size the size of a ResidentArray::BuilderNode
+*/
+MemoryState::MemoryState(HeapList *heaps_, size_t task_size, size_t message_size,
+                         size_t iorequest_size, size_t builder_size)
+    : heaps(heaps_)
+    , task_cache(heaps_, task_size)
+    , message_cache(heaps_, message_size)
+    , iorequest_cache(heaps_, iorequest_size)
+    , builder_cache(heaps_, builder_size)
+    , size_classes(heaps_)
+    , chip_pages(heaps_)
+    , large_objects(heaps_)
+    , heap_table(heaps_)
+    , mem_handlers()
+    , alloc_trace()
+    , alloc_profile(heaps_)
+    , heap_selection(HeapList::SELECT_PRIORITY)
+    , instrumented(0)
+{}
+
+/** Starts or stops tracing [Openkick SetAllocTrace()]; see AllocTrace::start().
+    \param log the Log to record calls in, or nullptr to stop tracing
+    \returns the previous Log, or nullptr if tracing was off
+*/
+AllocTrace::Log *MemoryState::start_trace(AllocTrace::Log *log) {
+    AllocTrace::Log *old = alloc_trace.start(log);
+    instrumented = alloc_trace.is_on() || alloc_profile.is_on();
+    return old;
+}
+
+/** Starts or stops profiling [Openkick SetAllocProfile()]; see AllocProfile::start().
+    \param period how many calls or bytes there are between samples, or 0 to stop profiling
+    \param mode what the period counts
+    \returns true on success, or false if there was no memory for the table
+*/
+bool MemoryState::start_profile(uint32_t period, AllocProfile::Mode mode) {
+    bool ok = alloc_profile.start(period, mode);
+    instrumented = alloc_trace.is_on() || alloc_profile.is_on();
+    return ok;
+}
+
+/** Stops other tasks from using the allocators until unlock() is called. Calls may be nested. As
+    with Heap::lock(), this is Forbid(), and hosted there is nothing to do.
+*/
+void MemoryState::lock(void) {
+#ifndef HOSTED_TEST
+    execbase->forbid();
+#endif
+}
+
+/** Lets other tasks use the allocators again after lock(). */
+void MemoryState::unlock(void) {
+#ifndef HOSTED_TEST
+    execbase->Permit();
+#endif
+}
+
+/** Allocates memory the way exec.library/AllocMem() does. Small Chip RAM allocations come from a
+    page, and large ones from an extent. The rest, or one that there is no page or extent for, come
+    from the HeapList; if that fails, the
+    free extents are given back and it is tried again, or else the low-memory handlers are called.
+    \param size the number of bytes to allocate
+    \param attributes the attributes of the memory required
+    \param options the allocation options
+    \returns pointer to the new memory, or nullptr if the allocation failed
+    \sa deallocate
+*/
+char *MemoryState::allocate(size_t size, Heap::Attributes attributes, Heap::Options options) {
+    char *memory = nullptr;
+    if(size <= ChipPages::LARGEST && ((unsigned)attributes & (unsigned)Heap::MEMF_CHIP)) {
+        lock();
+        memory = chip_pages.allocate(size, attributes, options);
+        unlock();
+    } else if(large_objects.is_large(size)) {
+        lock();
+        memory = large_objects.allocate(size, attributes, options);
+        unlock();
+    }
+    if(!memory)
+        memory = heaps->allocate(size, attributes, options, heap_selection);
+    if(!memory) {
+        lock();
+        bool released = large_objects.release();
+        unlock();
+        if(released)
+            memory = heaps->allocate(size, attributes, options, heap_selection, &mem_handlers);
+        else if(!((unsigned)options & (unsigned)Heap::MEMF_NO_EXPUNGE))
+            memory = mem_handlers.relieve(heaps, size, attributes, options, heap_selection);
+    }
+    return memory;
+}
+
+/** Finds whether memory was allocated from a Chip RAM page or an extent, rather than straight from a
+    Heap.
+    \param memory the memory
+    \returns true if it was
+*/
+bool MemoryState::owns(const char *memory) const {
+    return chip_pages.contains(memory) || large_objects.contains(memory);
+}
+
+/** Takes back memory that was allocated from a Chip RAM page or an extent.
+    \param memory the memory
+    \param size the number of bytes allocated
+    \returns false if \a memory belongs to a Heap instead, in which case nothing is done
+*/
+bool MemoryState::reclaim(char *memory, size_t size) {
+    return chip_pages.deallocate(memory, size) || large_objects.deallocate(memory, size);
+}
+
+/** Releases memory the way exec.library/FreeMem() does, to the page, extent or Heap that it came
+    from.
+    \param memory the memory
+    \param size the number of bytes allocated
+    \sa allocate
+*/
+void MemoryState::deallocate(char *memory, size_t size) {
+    lock();
+    if(!reclaim(memory, size))
+        heap_table.deallocate(memory, size);
+    unlock();
+}
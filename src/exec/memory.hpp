@@ -14,6 +14,8 @@
 class exec::Heap : public Node {
 public:
     class Chunk;
+    class Index;
+    class Statistics;
 
     /// memory attributes \ingroup exec_memory
     enum Attributes : uint16_t {
@@ -32,20 +34,30 @@ public:
         // AllocMem() options
         MEMF_CLEAR        = 0x1, //!< clear memory before returning
         MEMF_REVERSE      = 0x4, //!< allocate memory from the top of the pool (V36+)
-        MEMF_NO_EXPUNGE = 0x800, //!< fail rather than cause GC (V39+)
+        MEMF_NO_EXPUNGE = 0x8000, //!< fail rather than call the low-memory handlers (V39+)
         // AvailMem() options
         MEMF_LARGEST      = 0x2, //!< return the largest free chunk
         MEMF_TOTAL        = 0x8, //!< return the total memory size
     };
 
+    /// how an indexed heap chooses which free Chunk to allocate from \ingroup exec_memory
+    enum Policy : uint8_t {
+        POLICY_GOOD_FIT = 0,    //!< a Chunk from the smallest suitable size class
+        POLICY_NEXT_FIT = 1,    //!< the next suitable Chunk after the previous allocation
+    };
+
 private:
     friend class HeapList;
+    friend class HeapTable;
     const Attributes attributes; //!< memory attributes, values from Heap::Flags
     Chunk *first;                //!< address of first Memchunk in this zone
     const char *lower;           //!< starting address of this zone
     const char *upper;           //!< one-past-end address of this zone
     uint32_t free;               //!< amount of free space in this zone, in bytes
     // This structure is part of the AmigaOS ABI and may not be extended.
+
+    Index *index(void) const;
+    Chunk *release(Chunk *, char *, size_t);
 public:
 
     Heap(void);                 // disabled default ctor
@@ -71,32 +83,125 @@ public:
     bool provides(const Attributes a) const {
         return ((unsigned)attributes & (unsigned)a) == (unsigned)a;
     }
-    char *allocate [[gnu::malloc, gnu::assume_aligned(64)]] (size_t);
-    char *allocate_reverse [[gnu::malloc, gnu::assume_aligned(64)]] (size_t);
+    // every Chunk, and so every allocation, is aligned to at least 8 bytes
+    char *allocate [[gnu::malloc, gnu::assume_aligned(8)]] (size_t);
+    char *allocate_reverse [[gnu::malloc, gnu::assume_aligned(8)]] (size_t);
+    char *allocate_aligned [[gnu::malloc, gnu::assume_aligned(8)]] (size_t, size_t);
+    char *allocate_low [[gnu::malloc, gnu::assume_aligned(8)]] (size_t, size_t);
+    size_t allocate_n(size_t, size_t, char **) __attribute__((nonnull));
     char *allocate_at(char *, size_t);
+    char *reallocate(char *, size_t, size_t);
     void deallocate(char *, size_t);
+    size_t largest(void) const;
+    bool flush(void);
+    Policy policy(void) const;
+    bool was_zero(void) const;
+    void lock(void) const;
+    void unlock(void) const;
+    size_t scrub(size_t);
+    bool set_policy(Policy);
+    void statistics [[gnu::nonnull]] (Statistics *) const;
     size_t count_chunks(void) const;
     size_t count_free(void) const;
     bool is_sane(void) const;
 };
 
+/** how fragmented the free memory in a Heap is [Openkick HeapStatistics()] \ingroup exec_memory */
+class exec::Heap::Statistics {
+public:
+    enum : uint32_t {
+        BUCKETS = 32,           //!< the number of histogram buckets
+    };
+    uint32_t free;              //!< the number of free bytes
+    uint32_t chunks;            //!< the number of free Chunks
+    uint32_t largest;           //!< the size of the largest free Chunk
+    /// the share of the free memory that isn't in the largest free Chunk, in tenths of a percent
+    uint16_t fragmentation;
+    uint32_t histogram[BUCKETS]; //!< histogram[n] counts the free Chunks of 2^n to 2^(n+1)-1 bytes
+
+    void clear(void);
+    void add [[gnu::nonnull]] (const Statistics *);
+    void finish(void);
+};
+
+/** input and output of AllocEntry(), ROMTags, and used by Tasks for memory
+    autorelease [AmigaOS struct %MemList] \ingroup exec_memory
+ */
+class exec::MemEntry : public Node {
+    // disabled new/delete
+    void *operator new(size_t);
+    void operator delete(void *);
+public:
+    uint16_t count;             //!< number of allocations
+    /// one allocation, or one request for an allocation
+    struct Entry {
+        union {
+            char *addr;         //!< address of allocation
+            struct {
+                Heap::Options options;
+                Heap::Attributes attributes;
+            };
+        };
+        uint32_t size;          //!< size of allocation
+    } entries[0];               //!< the entries themselves
+    // This structure is part of the AmigaOS ABI and may not be extended.
+};
 
 /** List of Heap; used as the system memory pool \ingroup exec_memory */
 class exec::HeapList : private ListOf<exec::Heap> {
     // This structure is part of the AmigaOS ABI and may not be extended.
+    friend class HeapTable;
+    friend class LargeObjects;
+    friend class Debugger;
+public:
+    /// how allocate() chooses which Heap to allocate from \ingroup exec_memory
+    enum Selection : uint16_t {
+        SELECT_PRIORITY = 0,    //!< the first suitable Heap in priority order
+        SELECT_BEST_FIT = 1,    //!< the Heap whose largest free Chunk fits the request most tightly
+        SELECT_SPARE_CHIP = 2,  //!< as SELECT_PRIORITY, but Chip RAM last unless it's required
+    };
+private:
+    char *take(Heap *, size_t, Heap::Options, bool = true);
+    void advance(iterator &);
 public:
     HeapList(void);
     HeapList(HeapList *);
     char *allocate [[gnu::malloc]] (
         size_t,
         Heap::Attributes = Heap::MEMF_PUBLIC,
+        Heap::Options = Heap::MEMF_NONE,
+        Selection = SELECT_PRIORITY,
+        MemHandlerList * = nullptr
+      );
+    char *allocate_early [[gnu::malloc]] (
+        size_t,
+        Heap::Attributes = Heap::MEMF_PUBLIC,
+        Heap::Options = Heap::MEMF_NONE
+      );
+    size_t allocate_n [[gnu::nonnull]] (
+        size_t, size_t, char **,
+        Heap::Attributes = Heap::MEMF_PUBLIC,
+        Heap::Options = Heap::MEMF_NONE
+      );
+    char *allocate_aligned [[gnu::malloc]] (
+        size_t, size_t,
+        Heap::Attributes = Heap::MEMF_PUBLIC,
         Heap::Options = Heap::MEMF_NONE
       );
     char *allocate_at(char *, size_t) __attribute__((nonnull));
+    Heap *find [[gnu::pure]] (const char *) const;
+    char *reallocate(
+        char *, size_t, size_t,
+        Heap::Attributes = Heap::MEMF_PUBLIC,
+        Heap::Options = Heap::MEMF_NONE,
+        MemoryState * = nullptr
+      );
     void deallocate(char *, size_t) __attribute__((nonnull));
-    MemEntryResponse allocate_multiple(const MemEntry *);
+    MemEntryResponse allocate_multiple(const MemEntry *, MemoryState * = nullptr);
     MemEntryResponse allocate_multiple(uint32_t, ...) __attribute__((sentinel));
-    void deallocate_multiple(MemEntry *);
+    void deallocate_multiple(MemEntry *, MemoryState * = nullptr);
+    void deallocate_multiple(const MemEntry::Entry *, size_t, MemoryState * = nullptr);
+    void deallocate_multiple(MemEntryList *, MemoryState * = nullptr) __attribute__((nonnull(2)));
     MemEntry *allocate_mementry(size_t);
     void deallocate_mementry(MemEntry *);
     size_t available [[gnu::pure]] (
@@ -104,32 +209,242 @@ public:
         Heap::Options = Heap::MEMF_NONE
       ) const;
     Heap::Attributes type [[gnu::nonnull, gnu::pure]] (const char *) const;
+    void statistics [[gnu::nonnull]] (Heap::Statistics *) const;
     void add [[gnu::nonnull]] (Heap *);
     void add [[gnu::nonnull]] (size_t, Heap::Attributes, uint8_t, char *, const char *);
+    size_t scrub(size_t);
+    bool flush(void);
 };
 
-/** input and output of AllocEntry(), ROMTags, and used by Tasks for memory
-    autorelease [AmigaOS struct %MemList] \ingroup exec_memory
- */
-class exec::MemEntry : public Node {
-    // disabled new/delete
-    void *operator new(size_t);
-    void operator delete(void *);
+/** what a low-memory handler is told about the allocation that failed [AmigaOS struct
+    %MemHandlerData] \ingroup exec_memory */
+class exec::MemHandlerData {
 public:
-    uint16_t count;             //!< number of allocations
-    struct {
-        union {
-            char *addr;         //!< address of allocation
-            struct {
-                Heap::Options options;
-                Heap::Attributes attributes;
-            };
-        };
-        uint32_t size;          //!< size of allocation
-    } entries[0];               //!< the entries themselves
+    enum Flags : uint32_t {
+        MEMHF_RECYCLE = 1,      //!< the handler is being called again after returning MEM_TRY_AGAIN
+    };
+    uint32_t request_size;      //!< size of the failed allocation
+    uint32_t request_flags;     //!< requirements of the failed allocation, as passed to AllocMem()
+    uint32_t flags;             //!< values from MemHandlerData::Flags
     // This structure is part of the AmigaOS ABI and may not be extended.
 };
 
+/** the chain of low-memory handlers, which are asked to free some memory when an allocation fails
+    [AmigaOS AddMemHandler()] \ingroup exec_memory
+
+    Each handler is an Interrupt, and the chain is kept in priority order. A handler is called with
+    the MemHandlerData in a0, its is_Data in a1 and ExecBase in a6, and returns one of
+    MemHandlerList::Result in d0.
+*/
+class exec::MemHandlerList : private ListOf<exec::Interrupt> {
+public:
+    /// what a handler did [AmigaOS MEM_DID_NOTHING etc.]
+    enum Result : int32_t {
+        MEM_DID_NOTHING = 0,    //!< nothing was freed; try the next handler
+        MEM_ALL_DONE = -1,      //!< everything possible was freed; retry, then try the next handler
+        MEM_TRY_AGAIN = 1,      //!< some memory was freed; retry, then call this handler again
+    };
+    enum : unsigned {
+        RETRIES = 16,           //!< the most times a handler is called again after MEM_TRY_AGAIN
+    };
+private:
+    static int32_t call [[gnu::nonnull]] (Interrupt *, MemHandlerData *);
+public:
+    MemHandlerList(void);
+    void add [[gnu::nonnull]] (Interrupt *);
+    void remove [[gnu::nonnull]] (Interrupt *);
+    char *relieve [[gnu::nonnull]] (
+        HeapList *, size_t, Heap::Attributes, Heap::Options, HeapList::Selection
+      );
+};
+
+/** a record of the calls made to the allocator, for replaying against it offline \ingroup
+    exec_memory
+
+    Tracing is off until SetAllocTrace() is given a Log to fill, which it then uses as a ring buffer,
+    overwriting the oldest records once it is full. The Log can be saved to a file and replayed with
+    script/replay.
+*/
+class exec::AllocTrace {
+public:
+    /// what happened
+    enum Event : uint16_t {
+        EVENT_ALLOC_MEM = 1,    //!< AllocMem()
+        EVENT_FREE_MEM = 2,     //!< FreeMem()
+        EVENT_ALLOC_ABS = 3,    //!< AllocAbs()
+        EVENT_ALLOC_ENTRY = 4,  //!< one entry of an AllocEntry()
+        EVENT_FREE_ENTRY = 5,   //!< one entry of a FreeEntry()
+    };
+    /// one call
+    class Record {
+    public:
+        uint16_t event;         //!< value from AllocTrace::Event
+        uint32_t size;          //!< size requested
+        uint32_t requirements;  //!< requirements, as passed to AllocMem()
+        const char *address;    //!< address returned or freed, or nullptr if the allocation failed
+        const void *caller;     //!< return address of the call
+        uint32_t time;          //!< CIA B time-of-day counter, in horizontal lines
+    };
+    /// the buffer that records are written to
+    class Log {
+    public:
+        uint32_t capacity;      //!< number of records there is room for
+        uint32_t next;          //!< index of the next record to write
+        uint32_t count;         //!< number of records written in all, including overwritten ones
+        Record records[0];      //!< the records themselves
+    };
+private:
+    Log *log;                   //!< where to record calls, or nullptr if tracing is off
+
+    static uint32_t clock(void);
+    void append(Event, size_t, uint32_t, const char *, const void *);
+    void append(Event, const MemEntry *, const MemEntry *, const void *);
+public:
+    AllocTrace(void);
+    /** Records a call, if tracing is on.
+        \param event what happened
+        \param size the size requested
+        \param requirements the requirements, as passed to AllocMem()
+        \param address the address returned or freed
+        \param caller the return address of the call
+    */
+    void record(Event event, size_t size, uint32_t requirements, const char *address,
+                const void *caller) {
+        if(log)
+            append(event, size, requirements, address, caller);
+    }
+    /** Records every entry of an AllocEntry() or FreeEntry(), if tracing is on.
+        \param event what happened
+        \param requests the MemEntry that was asked for, or nullptr if the requirements are unknown
+        \param entries the MemEntry that was allocated or freed
+        \param caller the return address of the call
+    */
+    void record(Event event, const MemEntry *requests, const MemEntry *entries, const void *caller) {
+        if(log)
+            append(event, requests, entries, caller);
+    }
+    Log *start(Log *);
+    /** \returns whether tracing is on */
+    bool is_on(void) const { return log; }
+};
+
+/** a sampling profile of where allocations come from \ingroup exec_memory
+
+    Once started by SetAllocProfile(), every Nth call to AllocMem() or FreeMem(), or the call that
+    takes the total size past every Nth byte, is counted against its caller in a small hash table,
+    which DumpAllocProfile() prints. The table is only allocated while profiling is on.
+*/
+class exec::AllocProfile {
+public:
+    enum : uint32_t {
+        SITES = 64,                //!< the number of call sites there is room for
+    };
+    /// what the sampling period counts
+    enum Mode : uint16_t {
+        SAMPLE_CALLS = 0,          //!< calls
+        SAMPLE_BYTES = 1,          //!< bytes allocated or freed
+    };
+    /// the samples taken from one caller
+    class Site {
+    public:
+        const void *caller;        //!< the return address of the call, or nullptr if unused
+        uint32_t allocations;      //!< the number of allocations sampled
+        uint32_t frees;            //!< the number of frees sampled
+        uint32_t bytes;            //!< the total size of the allocations sampled
+    };
+private:
+    friend class Debugger;
+    HeapList *heaps;               //!< where the table comes from
+    Site *sites;                   //!< the table, or nullptr if profiling is off
+    uint32_t period;               //!< how many calls or bytes there are between samples
+    int32_t countdown;             //!< how many calls or bytes there are until the next sample
+    uint32_t dropped;              //!< the number of samples that found the table full
+    Mode mode;                     //!< what the period counts
+
+    void tick(size_t, const void *, bool);
+public:
+    AllocProfile(HeapList *) __attribute__((nonnull));
+    /** Counts an allocation, if profiling is on.
+        \param size the size allocated
+        \param caller the return address of the call
+    */
+    void allocated(size_t size, const void *caller) {
+        if(sites)
+            tick(size, caller, false);
+    }
+    /** Counts a free, if profiling is on.
+        \param size the size freed
+        \param caller the return address of the call
+    */
+    void freed(size_t size, const void *caller) {
+        if(sites)
+            tick(size, caller, true);
+    }
+    bool start(uint32_t, Mode);
+    /** \returns whether profiling is on */
+    bool is_on(void) const { return sites; }
+};
+
+/** a table of the address ranges of the heaps in a HeapList, sorted by address, which finds the Heap
+    that an address belongs to in O(log N) instead of walking the list in priority order \ingroup
+    exec_memory
+
+    The table also keeps running totals of the free memory for each distinct set of attributes,
+    which the heaps' Index objects update as they go, so that AvailMem() doesn't need to visit every
+    heap. Heaps without an Index are few and small, and are added up when asked.
+
+    The HeapList is part of the ABI and has no room for it, so the table is kept separately and has
+    to be rebuilt whenever a Heap is added.
+*/
+class exec::HeapTable {
+public:
+    enum : uint32_t {
+        CAPACITY = 16,             //!< the most heaps the table can hold
+    };
+    /// the answers to the usual AvailMem() questions, all at once
+    class Summary {
+    public:
+        uint32_t chip;             //!< free Chip RAM, in bytes
+        uint32_t fast;             //!< free Fast RAM, in bytes
+        uint32_t total;            //!< free memory of any kind, in bytes
+        uint32_t largest;          //!< the largest free chunk of any kind, in bytes
+    };
+private:
+    /// the running totals for one set of attributes
+    class Group {
+    public:
+        Heap::Attributes attributes; //!< the attributes of the heaps in the group
+        uint32_t free;             //!< free memory in the group's indexed heaps
+        uint32_t size;             //!< size of the group's heaps
+    };
+    /// the address range of one Heap
+    class Entry {
+    public:
+        const char *lower;         //!< starting address of the heap
+        const char *upper;         //!< one-past-end address of the heap
+        Heap *heap;                //!< the heap
+    };
+    HeapList *heaps;               //!< the heaps in the table
+    Entry entries[CAPACITY];       //!< the heaps' address ranges, in ascending order
+    Group groups[CAPACITY];        //!< the running totals for each set of attributes
+    uint16_t count;                //!< the number of entries in use
+    uint16_t group_count;          //!< the number of groups in use
+    uint16_t unindexed;            //!< the number of heaps without an Index
+    bool overflowed;               //!< whether some heaps didn't fit, and have to be looked for
+public:
+    HeapTable(HeapList *) __attribute__((nonnull));
+    void rebuild(void);
+    Heap *find [[gnu::pure]] (const char *) const;
+    char *allocate_at(char *, size_t) __attribute__((nonnull));
+    void deallocate(char *, size_t) __attribute__((nonnull));
+    Heap::Attributes type [[gnu::nonnull, gnu::pure]] (const char *) const;
+    size_t available [[gnu::pure]] (
+        Heap::Attributes = Heap::MEMF_ANY,
+        Heap::Options = Heap::MEMF_NONE
+      ) const;
+    void summarise(Summary *) const __attribute__((nonnull));
+};
+
 /** HeapList::allocate_multiple() response tuple */
 class exec::MemEntryResponse {
 public:
@@ -147,8 +462,208 @@ public:
 
 /** List of MemEntry; used by Tasks for memory autorelease \ingroup exec_memory */
 class exec::MemEntryList : private exec::ListOf<MemEntry> {
+    friend class HeapList;
 public:
     MemEntryList(void) : ListOf<MemEntry>(Node::NT_UNKNOWN) {}
 };
 
+/** a private memory pool, carved out of a HeapList in puddles [AmigaOS pool header] \ingroup
+    exec_memory */
+class exec::Pool {
+    class Block;
+    HeapList *heaps;               //!< where the memory comes from
+    ListOf<Heap> puddles;          //!< a Heap for each puddle, most recent first
+    MinList blocks;                //!< allocations that were too large for a puddle
+    Heap::Attributes attributes;   //!< the attributes of the memory
+    Heap::Options options;         //!< options for each allocation from the pool
+    uint32_t puddle_size;          //!< the size of the memory obtained for each puddle
+    uint32_t threshold;            //!< the largest allocation made from a puddle
+
+    Pool(HeapList *, Heap::Attributes, Heap::Options, size_t, size_t);
+    Heap *add_puddle(void);
+public:
+    static Pool *create(HeapList *, Heap::Attributes, Heap::Options, size_t, size_t)
+        __attribute__((nonnull));
+    void destroy(void);
+    char *allocate [[gnu::malloc]] (size_t);
+    void deallocate(char *, size_t) __attribute__((nonnull));
+};
+
+/** a cache of fixed-size objects, kept in slabs obtained from a HeapList \ingroup exec_memory */
+class exec::ObjectCache {
+    class Slab;
+    enum : uint32_t {
+        SLAB_SIZE = 2048,          //!< size and alignment of each slab
+    };
+    HeapList *heaps;               //!< where the slabs come from
+    MinList slabs;                 //!< slabs with free objects; completely unused ones last
+    uint16_t size;                 //!< the size of each object
+    uint16_t count;                //!< the number of objects in each slab
+    uint16_t unused;               //!< the number of slabs with no objects in use
+    uint32_t hits;                 //!< allocations made from an existing slab
+    uint32_t misses;               //!< allocations that needed a new slab or bypassed the cache
+
+    Slab *add_slab(void);
+public:
+    ObjectCache(HeapList *, size_t) __attribute__((nonnull));
+    char *allocate [[gnu::malloc]] (size_t);
+    void deallocate(char *, size_t);
+    /** \returns the number of allocations made from an existing slab */
+    uint32_t hit_count(void) const { return hits; }
+    /** \returns the number of allocations that needed a new slab or bypassed the cache */
+    uint32_t miss_count(void) const { return misses; }
+};
+
+/** the size-segregated pages behind the global operator new, which let small objects do without a
+    size header \ingroup exec_memory
+
+    Pages are carved out of arenas obtained from a HeapList, and every object in a page has the same
+    size. Each arena maps its pages to their size classes, and the arenas are kept in a tree by
+    address, so the size of a small object can be recovered from its address alone.
+*/
+class exec::SizeClasses {
+    class Arena;
+public:
+    enum : uint32_t {
+        PAGE_SIZE = 512,           //!< size of each page
+        ARENA_PAGES = 32,          //!< number of pages in each arena
+        CLASS_COUNT = 8,           //!< number of size classes
+        LARGEST = 128,             //!< the largest object that is served from a page
+    };
+private:
+    HeapList *heaps;               //!< where the arenas come from
+    AVLNode *arenas;               //!< the tree of arenas, by address
+    Arena *current[CLASS_COUNT];   //!< the arena of the page that each class allocates from
+    uint8_t page[CLASS_COUNT];     //!< and the number of that page within the arena
+
+    Arena *add_arena(void);
+    Arena *find_page(unsigned);
+public:
+    SizeClasses(HeapList *) __attribute__((nonnull));
+    char *allocate [[gnu::malloc]] (size_t);
+    bool deallocate(char *);
+};
+
+/** the pages of Chip RAM that small Chip RAM allocations are carved from, so that sprites, copper
+    lists and audio blocks don't fragment the Chip RAM Heap \ingroup exec_memory
+
+    Each page is divided into GRANULE-byte granules, with a bitmap recording which are in use. Pages
+    are taken from the top of Chip RAM as they are needed, and given back once they are unused, so
+    that the rest of it stays contiguous for large allocations.
+*/
+class exec::ChipPages {
+    class Page;
+public:
+    enum : uint32_t {
+        GRANULE = 16,              //!< the unit that pages are divided into
+        PAGE_SIZE = 2048,          //!< the memory in each page, less its header
+        LARGEST = 256,             //!< the largest allocation that is served from a page
+    };
+private:
+    enum : uint32_t {
+        GRANULES = PAGE_SIZE / GRANULE, //!< the number of granules in each page
+        WORDS = GRANULES / 32,     //!< the number of longwords in the bitmap of each page
+    };
+    HeapList *heaps;               //!< where the pages come from
+    Page *pages;                   //!< the pages, highest first
+    const char *lower;             //!< the lowest address of any page
+    const char *upper;             //!< one past the highest address of any page
+
+    Page *add_page(void);
+    void find_bounds(void);
+public:
+    ChipPages(HeapList *) __attribute__((nonnull));
+    char *allocate [[gnu::malloc]] (size_t, Heap::Attributes, Heap::Options);
+    bool deallocate(char *, size_t);
+    bool contains [[gnu::pure]] (const char *) const;
+};
+
+/** the page-aligned extents that large allocations, such as framebuffers and disk caches, are
+    served from, so that they don't interleave with small allocations \ingroup exec_memory
+
+    Allocations of at least the threshold are rounded up to whole pages and taken from the bottom of
+    a Heap, as other allocations are carved from the tops of Chunks. The extents are recorded in a
+    map of their own, in address order, rather than as Chunks. A freed extent is merged with any
+    free neighbours and kept for the next large allocation, so that it doesn't break up the Chunk
+    list, unless it is the highest extent in its Heap, in which case it is given back. That keeps
+    the large allocations packed together at the bottom of each Heap.
+*/
+class exec::LargeObjects {
+    /// a run of pages, either allocated or free
+    class Extent {
+    public:
+        char *address;          //!< the first page
+        uint32_t size;          //!< the size, which is a multiple of PAGE_SIZE
+        Heap *heap;             //!< the Heap that it was taken from
+        bool used;              //!< whether it is allocated
+    };
+public:
+    enum : uint32_t {
+        PAGE_SIZE = 4096,          //!< the unit that large allocations are rounded up to
+        EXTENT_COUNT = 32,         //!< the most extents in the map
+        DEFAULT_THRESHOLD = 65536, //!< the smallest allocation that is served from an extent
+    };
+private:
+    HeapList *heaps;               //!< where the extents come from
+    uint32_t threshold;            //!< the smallest allocation that is served from an extent, or 0
+    uint32_t count;                //!< the number of extents in the map
+    Extent extents[EXTENT_COUNT];  //!< the map, in ascending order of address
+
+    unsigned search [[gnu::pure]] (const char *) const;
+    void insert(unsigned, char *, uint32_t, Heap *) __attribute__((nonnull));
+    void remove(unsigned);
+    void hand_back(unsigned);
+    void give_back(unsigned);
+    char *add_extent(uint32_t, Heap::Attributes);
+public:
+    LargeObjects(HeapList *) __attribute__((nonnull));
+    /** \returns whether an allocation is large enough to be served from an extent
+        \param size the number of bytes to allocate */
+    bool is_large(size_t size) const { return threshold && size >= threshold; }
+    uint32_t set_threshold(uint32_t);
+    char *allocate [[gnu::malloc]] (size_t, Heap::Attributes, Heap::Options);
+    bool deallocate(char *, size_t);
+    bool contains [[gnu::pure]] (const char *) const;
+    size_t available [[gnu::pure]] (Heap::Attributes, Heap::Options) const;
+    bool release(void);
+    bool release(const char *, size_t) __attribute__((nonnull));
+};
+
+/** everything that the allocators keep besides the system HeapList, which ExecBase holds as one
+    private member after the V33 fields \ingroup exec_memory
+
+    New allocator state goes in here, so that none of it is public in ExecBase. Memory from the
+    Chip RAM pages and extents is inside the Heaps, so it has to be given back through deallocate(), or a
+    HeapList function that is passed the MemoryState, rather than straight to its Heap.
+*/
+class exec::MemoryState {
+    HeapList *heaps;              //!< the system HeapList
+
+    void lock(void);
+    void unlock(void);
+public:
+    ObjectCache task_cache;       //!< backs Task::operator new
+    ObjectCache message_cache;    //!< backs Message::operator new
+    ObjectCache iorequest_cache;  //!< backs IORequest::operator new
+    ObjectCache builder_cache;    //!< backs ResidentArray::BuilderNode::operator new
+    SizeClasses size_classes;     //!< backs the global operator new for small objects
+    ChipPages chip_pages;         //!< backs AllocMem() for small Chip RAM allocations
+    LargeObjects large_objects;   //!< backs AllocMem() for large allocations
+    HeapTable heap_table;         //!< finds the Heap of an address for FreeMem() and friends
+    MemHandlerList mem_handlers;  //!< called when AllocMem() runs out of memory
+    AllocTrace alloc_trace;       //!< records allocator calls for SetAllocTrace()
+    AllocProfile alloc_profile;   //!< samples allocator callers for SetAllocProfile()
+    HeapList::Selection heap_selection; //!< how AllocMem() chooses a Heap
+    /// nonzero if tracing or profiling is on, so that AllocMem() and FreeMem() need only test this
+    uint16_t instrumented;
+
+    MemoryState(HeapList *, size_t, size_t, size_t, size_t) __attribute__((nonnull));
+    AllocTrace::Log *start_trace(AllocTrace::Log *);
+    bool start_profile(uint32_t, AllocProfile::Mode);
+    char *allocate [[gnu::malloc]] (size_t, Heap::Attributes, Heap::Options);
+    bool owns [[gnu::pure]] (const char *) const;
+    bool reclaim(char *, size_t);
+    void deallocate(char *, size_t);
+};
+
 #endif
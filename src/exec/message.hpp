@@ -17,6 +17,9 @@ class exec::Message : private Node {
     // This structure is part of the AmigaOS ABI and may not be extended.
     friend class Port;
 public:
+    void *operator new(size_t);
+    void operator delete(void *, size_t);
+
     void send(Port *port);
 
     void reply(void);
@@ -1,6 +1,7 @@
 # -*- makefile -*-
 
 EXEC_SRC += \
+	src/exec/avl.cpp \
 	src/exec/debugger.cpp \
 	src/exec/execbase.cpp \
 	src/exec/gcc.asm \
@@ -15,6 +16,9 @@ EXEC_SRC += \
 	src/exec/types.cpp \
 
 TESTSRC += \
+	src/exec/avl.cpp \
+	src/exec/libc.cpp \
 	src/exec/memory.cpp \
 	src/exec/list.cpp \
+	src/exec/sharedheap.cpp \
 
@@ -1,12 +1,29 @@
 #include <types.hpp>
 #include <exec/execbase.hpp>
+#include <exec/libc.hpp> // for bzero
 using namespace exec;
 
 /* Note that AmigaOS AllocMem/FreeMem does not maintain the allocation size. Objects that are
    expected to be created/deleted via an external AllocMem()/FreeMem() will need to define operator
-   new/delete for that class. */
+   new/delete for that class.
+
+   Small objects of ordinary memory come from the size-class pages of MemoryState::size_classes, which
+   can tell the size of an object from its address. Everything else is allocated with its size in a
+   header in front of it. */
 
 static void *allocate(size_t size, Heap::Attributes attributes, Heap::Options options) {
+    if(size <= SizeClasses::LARGEST && (attributes & ~Heap::MEMF_PUBLIC) == 0
+       && (options & ~Heap::MEMF_CLEAR) == 0) {
+        execbase->forbid();
+        char *object = execbase->memory()->size_classes.allocate(size);
+        execbase->Permit();
+        if(object) {
+            if(options & Heap::MEMF_CLEAR)
+                bzero(object, size);
+            return object;
+        }
+    }
+
     uint32_t *alloc = reinterpret_cast<uint32_t *>(
         execbase->AllocMem(size + 8, attributes + (options << 16))
         );
@@ -19,6 +36,14 @@ static void *allocate(size_t size, Heap::Attributes attributes, Heap::Options op
 }
 
 static void release(void *mem) {
+    if(!mem)
+        return;
+    execbase->forbid();
+    bool small = execbase->memory()->size_classes.deallocate(static_cast<char *>(mem));
+    execbase->Permit();
+    if(small)
+        return;
+
     uint32_t *alloc = static_cast<uint32_t *>(mem);
     alloc -= 2;
     execbase->FreeMem(reinterpret_cast<char *>(alloc), alloc[0]);
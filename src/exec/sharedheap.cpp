@@ -0,0 +1,300 @@
+// -*- mode: c++ -*-
+/**
+   Multi-threaded access to a HeapList in hosted builds (implementation)
+   \file
+
+   This is only built hosted, where memory.cpp may be run by many threads at once; exec itself has
+   a single CPU and serialises its callers with Forbid().
+*/
+
+#include <exec/sharedheap.hpp>
+
+#include <cstring>
+
+using namespace exec;
+
+/** a stack of free blocks of one size class */
+class exec::SharedHeapList::Magazine {
+public:
+    Magazine *next;             //!< the next magazine in the depot
+    uint32_t rounds;            //!< the number of blocks in \a round
+    MemEntry::Entry round[ROUNDS]; //!< the blocks, as address and size for deallocate_multiple()
+};
+
+// -------------------- SharedHeapList --------------------
+
+/** constructor.
+    \param heaps_ the HeapList to share, which must only be used through this from now on
+*/
+SharedHeapList::SharedHeapList(HeapList *heaps_) : heaps(heaps_), lock() {
+    for(unsigned c = 0; c < CLASS_COUNT; ++c) {
+        depots[c].full = depots[c].empty = nullptr;
+        depots[c].full_count = 0;
+    }
+}
+
+/** destructor. Every Cache must have been destroyed first. */
+SharedHeapList::~SharedHeapList(void) {
+    drain();
+}
+
+/** Takes an empty magazine from the depot, or makes a new one. The lock must be held.
+    \param c the size class
+    \returns the magazine, or nullptr if there was no memory for it
+*/
+SharedHeapList::Magazine *SharedHeapList::take_empty(unsigned c) {
+    Depot &depot = depots[c];
+    Magazine *magazine = depot.empty;
+    if(magazine) {
+        depot.empty = magazine->next;
+    } else {
+        magazine = reinterpret_cast<Magazine *>(heaps->allocate(sizeof(Magazine)));
+        if(!magazine)
+            return nullptr;
+        magazine->rounds = 0;
+    }
+    magazine->next = nullptr;
+    return magazine;
+}
+
+/** Gives the blocks in a magazine back to the HeapList. The lock must be held.
+    \param magazine the magazine, which is left empty
+*/
+void SharedHeapList::release(Magazine *magazine) {
+    heaps->deallocate_multiple(magazine->round, magazine->rounds);
+    magazine->rounds = 0;
+}
+
+/** Gives a Cache a magazine to allocate from, after both of its magazines of a class have run out.
+    A full magazine is taken from the depot if there is one; otherwise a magazine is refilled with a
+    batch of blocks from the HeapList.
+    \param c the size class
+    \param loaded the Cache's loaded magazine, which may be nullptr
+    \param previous the Cache's previous magazine, which may be nullptr
+*/
+void SharedHeapList::reload(unsigned c, Magazine **loaded, Magazine **previous) {
+    std::lock_guard<std::mutex> guard(lock);
+    Depot &depot = depots[c];
+    if(Magazine *full = depot.full) {
+        depot.full = full->next;
+        --depot.full_count;
+        if(Magazine *empty = *previous) {
+            empty->next = depot.empty;
+            depot.empty = empty;
+        }
+        *previous = *loaded;
+        *loaded = full;
+        return;
+    }
+
+    Magazine *magazine = *loaded ? *loaded : take_empty(c);
+    if(!magazine)
+        return;
+    *loaded = magazine;
+    size_t size = (c + 1) * QUANTUM;
+    char *batch[REFILL];
+    size_t n = heaps->allocate_n(size, REFILL, batch);
+    for(size_t i = 0; i < n; ++i) {
+        magazine->round[i].addr = batch[i];
+        magazine->round[i].size = size;
+    }
+    magazine->rounds = n;
+}
+
+/** Gives a Cache an empty magazine to free into, after both of its magazines of a class have
+    filled up. The previous magazine goes to the depot, or its blocks go back to the HeapList if the
+    depot already has enough, and the loaded one becomes the previous one.
+    \param c the size class
+    \param loaded the Cache's loaded magazine, which may be nullptr; it is left as nullptr if there
+    was no memory for a new one
+    \param previous the Cache's previous magazine, which may be nullptr
+*/
+void SharedHeapList::unload(unsigned c, Magazine **loaded, Magazine **previous) {
+    std::lock_guard<std::mutex> guard(lock);
+    Depot &depot = depots[c];
+    if(Magazine *old = *previous) {
+        if(old->rounds && depot.full_count < DEPOT_LIMIT) {
+            old->next = depot.full;
+            depot.full = old;
+            ++depot.full_count;
+        } else {
+            release(old);
+            old->next = depot.empty;
+            depot.empty = old;
+        }
+    }
+    *previous = *loaded;
+    *loaded = take_empty(c);
+}
+
+/** Gives all of a Cache's blocks back to the HeapList, and its magazines to the depot.
+    \param loaded the Cache's loaded magazines, which are set to nullptr
+    \param previous the Cache's previous magazines, which are set to nullptr
+*/
+void SharedHeapList::flush(Magazine **loaded, Magazine **previous) {
+    std::lock_guard<std::mutex> guard(lock);
+    for(unsigned c = 0; c < CLASS_COUNT; ++c) {
+        Magazine *magazines[2] = {loaded[c], previous[c]};
+        for(Magazine *magazine : magazines) {
+            if(!magazine)
+                continue;
+            release(magazine);
+            magazine->next = depots[c].empty;
+            depots[c].empty = magazine;
+        }
+        loaded[c] = previous[c] = nullptr;
+    }
+}
+
+/** Gives the blocks and magazines in the depot back to the HeapList. The lock must be held.
+    \returns true if anything was given back
+*/
+bool SharedHeapList::drain_locked(void) {
+    bool released = false;
+    for(unsigned c = 0; c < CLASS_COUNT; ++c) {
+        Depot &depot = depots[c];
+        while(Magazine *magazine = depot.full) {
+            depot.full = magazine->next;
+            release(magazine);
+            magazine->next = depot.empty;
+            depot.empty = magazine;
+        }
+        depot.full_count = 0;
+        while(Magazine *magazine = depot.empty) {
+            depot.empty = magazine->next;
+            heaps->deallocate(reinterpret_cast<char *>(magazine), sizeof(Magazine));
+            released = true;
+        }
+    }
+    return released;
+}
+
+/** Gives the blocks and magazines in the depot back to the HeapList. Blocks in the magazines of a
+    Cache are not affected.
+    \returns true if anything was given back
+*/
+bool SharedHeapList::drain(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return drain_locked();
+}
+
+/** Allocates memory from the HeapList, bypassing the magazines. If that fails, the depot is
+    drained and the allocation tried again.
+    \param size the number of bytes to allocate
+    \param attributes the attributes of the memory required
+    \param options the allocation options
+    \returns pointer to the new memory, or nullptr if the allocation failed
+*/
+char *SharedHeapList::allocate(size_t size, Heap::Attributes attributes, Heap::Options options) {
+    std::lock_guard<std::mutex> guard(lock);
+    char *memory = heaps->allocate(size, attributes, options);
+    if(!memory && drain_locked())
+        memory = heaps->allocate(size, attributes, options);
+    return memory;
+}
+
+/** Frees memory into the HeapList, bypassing the magazines.
+    \param address the memory to free
+    \param size the size of the memory
+*/
+void SharedHeapList::deallocate(char *address, size_t size) {
+    std::lock_guard<std::mutex> guard(lock);
+    heaps->deallocate(address, size);
+}
+
+/** Reports the amount of free memory, as HeapList::available(). Blocks held in magazines are not
+    counted as free; drain() first if that matters.
+    \param attributes the attributes of the memory to count
+    \param options MEMF_LARGEST or MEMF_TOTAL, if required
+    \returns the amount of memory matching the description
+*/
+size_t SharedHeapList::available(Heap::Attributes attributes, Heap::Options options) {
+    std::lock_guard<std::mutex> guard(lock);
+    return heaps->available(attributes, options);
+}
+
+// -------------------- SharedHeapList::Cache --------------------
+
+/** constructor. The Cache starts with no magazines.
+    \param shared_ the SharedHeapList to allocate from
+*/
+SharedHeapList::Cache::Cache(SharedHeapList *shared_) : shared(shared_), hits(0), misses(0) {
+    for(unsigned c = 0; c < CLASS_COUNT; ++c)
+        loaded[c] = previous[c] = nullptr;
+}
+
+/** destructor. The cached blocks are given back to the HeapList. */
+SharedHeapList::Cache::~Cache(void) {
+    flush();
+}
+
+/** Allocates memory, from a magazine if possible.
+    \param size the number of bytes to allocate
+    \param attributes the attributes of the memory required
+    \param options the allocation options
+    \returns pointer to the new memory, or nullptr if the allocation failed
+*/
+char *SharedHeapList::Cache::allocate(size_t size, Heap::Attributes attributes,
+                                      Heap::Options options) {
+    if(!size || size > LARGEST
+       || ((unsigned)attributes & ~(unsigned)Heap::MEMF_PUBLIC)
+       || ((unsigned)options & ~(unsigned)Heap::MEMF_CLEAR)) {
+        ++misses;
+        return shared->allocate(size, attributes, options);
+    }
+
+    unsigned c = (size - 1) / QUANTUM;
+    Magazine *magazine = loaded[c];
+    if(magazine && magazine->rounds) {
+        ++hits;
+    } else if(previous[c] && previous[c]->rounds) {
+        loaded[c] = previous[c];
+        previous[c] = magazine;
+        magazine = loaded[c];
+        ++hits;
+    } else {
+        ++misses;
+        shared->reload(c, &loaded[c], &previous[c]);
+        magazine = loaded[c];
+        if(!magazine || !magazine->rounds)
+            return shared->allocate(size, attributes, options);
+    }
+
+    char *memory = magazine->round[--magazine->rounds].addr;
+    if((unsigned)options & (unsigned)Heap::MEMF_CLEAR)
+        memset(memory, 0, size);
+    return memory;
+}
+
+/** Frees memory into a magazine if possible.
+    \param address the memory to free
+    \param size the size of the memory, as passed to allocate()
+*/
+void SharedHeapList::Cache::deallocate(char *address, size_t size) {
+    if(!size || size > LARGEST)
+        return shared->deallocate(address, size);
+
+    unsigned c = (size - 1) / QUANTUM;
+    Magazine *magazine = loaded[c];
+    if(!magazine || magazine->rounds == ROUNDS) {
+        if(previous[c] && !previous[c]->rounds) {
+            loaded[c] = previous[c];
+            previous[c] = magazine;
+        } else {
+            shared->unload(c, &loaded[c], &previous[c]);
+        }
+        magazine = loaded[c];
+        if(!magazine)
+            return shared->deallocate(address, size);
+    }
+
+    // a Heap rounds sizes up to a multiple of QUANTUM, so this is the size that it allocated
+    MemEntry::Entry &round = magazine->round[magazine->rounds++];
+    round.addr = address;
+    round.size = (c + 1) * QUANTUM;
+}
+
+/** Gives all of the cached blocks back to the HeapList. */
+void SharedHeapList::Cache::flush(void) {
+    shared->flush(loaded, previous);
+}
@@ -0,0 +1,103 @@
+// -*- mode: c++ -*-
+/**
+   Multi-threaded access to a HeapList in hosted builds (headers)
+   \file
+*/
+
+#ifndef EXEC_SHAREDHEAP_HPP
+#define EXEC_SHAREDHEAP_HPP
+
+#ifndef HOSTED_TEST
+#error "SharedHeapList is only for hosted builds; exec itself serialises with Forbid()"
+#endif
+
+#include <exec/memory.hpp>
+
+#include <mutex>
+
+/** a HeapList that many host threads can allocate from at once \ingroup exec_memory
+
+    Every call into the HeapList is made with a lock held. That is all that allocate() and
+    deallocate() do, so on their own they serialise every thread on the one lock; threads that make
+    a lot of small allocations should each go through a Cache of their own instead.
+
+    Small blocks are cached in magazines, each of which holds up to ROUNDS blocks of one size class.
+    A Cache keeps two magazines per class and allocates from and frees into those without taking
+    the lock. When both are exhausted it swaps one with the depot, which holds the magazines that
+    are not in any Cache, or refills one with a batch from the HeapList. In the same way, when both
+    are full, one goes back to the depot, and once the depot has DEPOT_LIMIT full magazines of a
+    class their blocks go back to the HeapList in a single batch.
+*/
+class exec::SharedHeapList {
+public:
+    class Cache;
+    enum : uint32_t {
+        QUANTUM = 8,               //!< the size classes are multiples of this, as Heap sizes are
+        CLASS_COUNT = 32,          //!< number of size classes
+        LARGEST = QUANTUM * CLASS_COUNT, //!< the largest block that is cached
+        ROUNDS = 32,               //!< the most blocks that a magazine holds
+        REFILL = ROUNDS / 2,       //!< the blocks taken from the HeapList to refill a magazine
+        DEPOT_LIMIT = 8,           //!< the most full magazines of each class kept in the depot
+    };
+private:
+    class Magazine;
+    /// the magazines of one size class that aren't in any Cache
+    class Depot {
+    public:
+        Magazine *full;            //!< magazines with blocks in them
+        Magazine *empty;           //!< magazines with none
+        uint32_t full_count;       //!< the number of magazines in \a full
+    };
+    HeapList *heaps;               //!< where the memory comes from
+    std::mutex lock;               //!< held while \a heaps or \a depots are in use
+    Depot depots[CLASS_COUNT];     //!< the depot for each size class
+
+    Magazine *take_empty(unsigned);
+    void release(Magazine *) __attribute__((nonnull));
+    void reload(unsigned, Magazine **, Magazine **) __attribute__((nonnull));
+    void unload(unsigned, Magazine **, Magazine **) __attribute__((nonnull));
+    void flush(Magazine **, Magazine **) __attribute__((nonnull));
+    bool drain_locked(void);
+public:
+    SharedHeapList(HeapList *) __attribute__((nonnull));
+    ~SharedHeapList(void);
+    char *allocate [[gnu::malloc]] (
+        size_t,
+        Heap::Attributes = Heap::MEMF_PUBLIC,
+        Heap::Options = Heap::MEMF_NONE
+      );
+    void deallocate(char *, size_t) __attribute__((nonnull));
+    size_t available(Heap::Attributes = Heap::MEMF_ANY, Heap::Options = Heap::MEMF_NONE);
+    bool drain(void);
+};
+
+/** one thread's magazines; it must only be used by the thread that owns it
+
+    Only MEMF_ANY and MEMF_PUBLIC allocations of up to LARGEST bytes, with no option other than
+    MEMF_CLEAR, are served from the magazines; anything else goes straight to the SharedHeapList.
+    Blocks are cached whichever Heap they came from, so they may be handed out to a request that
+    couldn't have been served from that Heap, but only in that exec doesn't enforce MEMF_PUBLIC.
+*/
+class exec::SharedHeapList::Cache {
+    SharedHeapList *shared;        //!< where the magazines come from
+    Magazine *loaded[CLASS_COUNT]; //!< the magazine that each class allocates from and frees into
+    Magazine *previous[CLASS_COUNT]; //!< the one before it, which is either full or empty
+    uint32_t hits;                 //!< allocations served from a magazine
+    uint32_t misses;               //!< allocations that needed the lock
+public:
+    Cache(SharedHeapList *) __attribute__((nonnull));
+    ~Cache(void);
+    char *allocate [[gnu::malloc]] (
+        size_t,
+        Heap::Attributes = Heap::MEMF_PUBLIC,
+        Heap::Options = Heap::MEMF_NONE
+      );
+    void deallocate(char *, size_t) __attribute__((nonnull));
+    void flush(void);
+    /** \returns the number of allocations served from a magazine */
+    uint32_t hit_count(void) const { return hits; }
+    /** \returns the number of allocations that needed the lock */
+    uint32_t miss_count(void) const { return misses; }
+};
+
+#endif
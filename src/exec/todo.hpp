@@ -103,7 +103,7 @@ public:
     void *user_data;
 public:
     void *operator new(size_t);
-    void operator delete(void *);
+    void operator delete(void *, size_t);
 
     Task(const char *name_)
         : Node(Node::NT_TASK, 0, name_)
@@ -122,7 +122,7 @@ public:
 };
 
 /** (Stub declaration) */
-struct exec::Interrupt : private Node {
+struct exec::Interrupt : public Node {
     void *data;
     void (*code)(void);
 public:
@@ -184,11 +184,6 @@ namespace exec {
     enum CACRF {};
 }
 
-/** (Stub declaration) */
-class exec::AVLNode {
-    uint32_t reserved[4];
-};
-
 /** (Stub declaration) */
 class exec::IORequest : public Message {
     enum Command {
@@ -199,6 +194,9 @@ class exec::IORequest : public Message {
     uint16_t command;
     uint8_t flags;
     int8_t error;
+public:
+    void *operator new(size_t);
+    void operator delete(void *, size_t);
 };
 
 /** (Stub declaration) */
@@ -5,6 +5,7 @@
 */
 
 #include <exec/types.hpp>
+#include <exec/avl.hpp>
 #include <exec/list.hpp>
 #include <exec/library.hpp>
 #include <exec/memory.hpp>
@@ -43,7 +44,8 @@ struct_size_assert(Unit, Unit, sizeof(Port) + 4)
 
 struct_size_assert(ExecBase, ExecBase,
     sizeof(Library) + 50 + sizeof(IntVector)*16 + 46 +
-    sizeof(List)*8 + sizeof(SoftIntList)*5 + 18 + sizeof(List) + 12
+    sizeof(List)*8 + sizeof(SoftIntList)*5 + 18 + sizeof(List) + 12 +
+    sizeof(MemoryState) // Openkick private
   )
 
 struct_size_assert(anon_HeapList, HeapList, sizeof(List))
@@ -51,6 +53,7 @@ struct_size_assert(anon_ResourceList, ResourceList, sizeof(List))
 struct_size_assert(anon_DeviceList, DeviceList, sizeof(List))
 struct_size_assert(anon_InterruptList, InterruptList, sizeof(List))
 struct_size_assert(anon_LibraryList, LibraryList, sizeof(List))
+struct_size_assert(anon_MemHandlerList, MemHandlerList, sizeof(List))
 struct_size_assert(anon_PortList, PortList, sizeof(List))
 struct_size_assert(anon_TaskList, TaskList, sizeof(List))
 
@@ -85,8 +88,8 @@ struct_size_assert(MemHeader, Heap, sizeof(Node) + 18)
 // struct_size_assert(MemEntry, MemEntry, 8)
 // note: MemList is not a MemoryList!
 // struct_size_assert(MemList, MemList, 8)
-// MemHandlerData is V39+
-// struct_size_assert(MemHandlerData, MemHandlerData, 12)
+struct_size_assert(MemHandlerData, MemHandlerData, 12) // V39+
+struct_size_assert(AllocTrace_Record, AllocTrace::Record, 22) // Openkick; read by script/replay
 
 // exec/nodes.h: Node, MinNode
 
@@ -19,7 +19,11 @@
 */
 namespace exec {
     class AVLNode;
+    class AllocProfile;
+    class AllocTrace;
     class CPUFeatures;
+    class ChipPages;
+    class LargeObjects;
     class Device;
     class DeviceList;
     class Debugger;
@@ -27,6 +31,7 @@ namespace exec {
     class Formatter;
     class Heap;
     class HeapList;
+    class HeapTable;
     class IORequest;
     class IOStdReq;
     class IntVector;
@@ -39,13 +44,18 @@ namespace exec {
     class MemEntry;
     class MemEntryList;
     class MemEntryResponse;
+    class MemHandlerData;
+    class MemHandlerList;
+    class MemoryState;
     class Message;
     class MinList;
     template <typename node_t> class MinListOf;
     class MinNode;
     class Node;
+    class ObjectCache;
     class PackedFunctions;
     class PackedStruct;
+    class Pool;
     class Port;
     class PortList;
     class Resident;
@@ -55,8 +65,10 @@ namespace exec {
     class Semaphore;
     class SemaphoreMessage;
     class SemaphoreRequest;
+    class SharedHeapList;
     class SignalSemaphore;
     class SignalSemaphoreList;
+    class SizeClasses;
     class SoftIntList;
     class Task;
     class TaskList;
@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <stdint.h>
 #define struct_size_assert(NAME, TYPE, SIZE);
+typedef uintptr_t address_t;    //!< a memory address (same size as a pointer)
 #else
 typedef signed long int32_t;         //!< 32 bit signed type
 typedef unsigned long uint32_t;      //!< 32 bit unsigned type
@@ -19,9 +20,9 @@ typedef unsigned long long uint64_t; //!< 64 bit unsigned type
 
 typedef uint32_t size_t;        //!< sizeof() return type
 typedef int32_t ptrdiff_t;      //!< pointer difference type
+typedef unsigned int address_t; //!< a memory address (same size as a pointer)
 
 #endif
-typedef unsigned int address_t; //!< a memory address (same size as a pointer)
 
 typedef signed char int8_t;          //!< 8 bit signed type
 typedef unsigned char uint8_t;       //!< 8 bit unsigned type
@@ -0,0 +1,299 @@
+// -*- mode: c++ -*-
+/**
+   Tests the Index of a Heap against a model of its free memory.
+   \file
+
+   Random sequences of allocations, frees, AllocAbs()-style allocations and resizes are made from an
+   indexed Heap, and the same changes are made to a plain map of the free ranges. After every step
+   the Heap's O(1) figures must agree with its own linear walk of the Chunk list, and both with the
+   model; Heap::is_sane() checks the tree and the size classes against the Chunk list.
+
+   The results are in TAP, for "make test".
+*/
+
+#include <exec/memory.hpp>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+using namespace exec;
+
+/** inserts a node in priority order; the ROM's version is in assembler, so isn't hosted
+    \param node_ the node to insert
+*/
+void List::enqueue(Node *node_) {
+    for(iterator i = begin(); i != end(); ++i)
+        if(i->priority < node_->priority)
+            return node_->insert_before(*i);
+    return push(node_);
+}
+
+namespace {
+    /// every size and offset is a multiple of this, which is a multiple of the granule on any host
+    const size_t UNIT = 64;
+    const size_t HEAP_SIZE = 1 << 20;
+    const int STEPS = 20000;
+
+    unsigned tests;
+
+    /** reports the result of a test
+        \param passed whether it passed
+        \param format printf() format of the test's description
+        \returns \a passed
+    */
+    bool ok(bool passed, const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        printf("%s %u - ", passed ? "ok" : "not ok", ++tests);
+        vprintf(format, args);
+        printf("\n");
+        va_end(args);
+        return passed;
+    }
+
+    /// the free memory of a Heap, as ranges from start to end
+    class Model {
+        std::map<char *, char *> ranges;
+        size_t total;
+
+    public:
+        Model(char *start, char *end) : ranges(), total(end - start) { ranges[start] = end; }
+
+        size_t available(void) const { return total; }
+        size_t count(void) const { return ranges.size(); }
+
+        size_t largest(void) const {
+            size_t size = 0;
+            for(auto &range : ranges)
+                if(size_t(range.second - range.first) > size)
+                    size = range.second - range.first;
+            return size;
+        }
+
+        /** finds whether memory is free
+            \returns true if it's all inside one free range */
+        bool is_free(char *start, char *end) const {
+            auto i = ranges.upper_bound(start);
+            if(i == ranges.begin())
+                return false;
+            --i;
+            return end <= i->second;
+        }
+
+        /// marks free memory as allocated, which must be inside one free range
+        void take(char *start, char *end) {
+            auto i = --ranges.upper_bound(start);
+            char *bottom = i->first, *top = i->second;
+            ranges.erase(i);
+            if(bottom < start)
+                ranges[bottom] = start;
+            if(end < top)
+                ranges[end] = top;
+            total -= end - start;
+        }
+
+        /// marks allocated memory as free, merging it with the free ranges either side
+        void give(char *start, char *end) {
+            total += end - start;
+            auto next = ranges.find(end);
+            if(next != ranges.end()) {
+                end = next->second;
+                ranges.erase(next);
+            }
+            auto i = ranges.lower_bound(start);
+            if(i != ranges.begin() && (--i)->second == start)
+                i->second = end;
+            else
+                ranges[start] = end;
+        }
+    };
+
+    /// an allocation that the test holds
+    struct Block {
+        char *memory;
+        size_t size;
+    };
+
+    /// a Heap to test, in memory of its own
+    class Fixture {
+    public:
+        char *base;
+        Heap *heap;
+        char *start;            //!< the free memory of the new Heap, above its header and Index
+        char *end;              //!< one past the end of it
+
+        Fixture(void) : base(static_cast<char *>(aligned_alloc(4096, HEAP_SIZE))), heap(nullptr) {
+            heap = Heap::create(HEAP_SIZE, Heap::MEMF_PUBLIC, 0, base, "test");
+            end = base + HEAP_SIZE;
+            start = end - heap->available();
+        }
+        ~Fixture(void) { free(base); }
+    };
+
+    size_t random_size(void) {
+        return UNIT * (1 + (rand() % 8 ? rand() % 16 : rand() % 1024));
+    }
+
+    /** checks a Heap against the model
+        \param exact whether the quick-lists have been flushed, so the Chunks should match the
+        model's ranges exactly
+        \returns nullptr if it agrees, otherwise what didn't
+    */
+    const char *check(Heap *heap, const Model &model, bool exact) {
+        if(!heap->is_sane())
+            return "the Index doesn't match the Chunk list";
+        if(heap->available() != model.available())
+            return "available() doesn't match the model";
+        if(heap->count_free() != model.available())
+            return "count_free() doesn't match the model";
+        Heap::Statistics stats;
+        heap->statistics(&stats);
+        if(stats.free != heap->count_free() || stats.chunks != heap->count_chunks())
+            return "statistics() doesn't match the Chunk list";
+        if(stats.largest != heap->largest())
+            return "largest() doesn't match the Chunk list";
+        if(exact && heap->count_chunks() != model.count())
+            return "count_chunks() doesn't match the model";
+        if(exact && heap->largest() != model.largest())
+            return "largest() doesn't match the model";
+        return nullptr;
+    }
+
+    /** makes random changes to a Heap and the model of it, checking that they agree
+        \param seed the seed for rand()
+        \param policy the Heap's allocation policy
+        \param step receives the number of steps made
+        \returns nullptr if they always agreed, otherwise what didn't
+    */
+    const char *random_operations(unsigned seed, Heap::Policy policy, int &step) {
+        Fixture fixture;
+        Heap *heap = fixture.heap;
+        heap->set_policy(policy);
+        Model model(fixture.start, fixture.end);
+        std::vector<Block> live;
+        srand(seed);
+
+        for(step = 0; step < STEPS; ++step) {
+            int op = rand() % 16;
+            if(op < 5) {
+                size_t size = random_size();
+                char *memory = op < 4 ? heap->allocate(size) : heap->allocate_reverse(size);
+                if(!memory) {
+                    if(model.largest() >= size)
+                        return "an allocation failed that would have fitted";
+                } else if(!model.is_free(memory, memory + size)) {
+                    return "an allocation overlapped allocated memory";
+                } else {
+                    model.take(memory, memory + size);
+                    live.push_back({memory, size});
+                }
+            } else if(op < 7) {
+                size_t size = random_size();
+                char *memory = fixture.start
+                    + UNIT * (rand() % ((fixture.end - fixture.start) / UNIT));
+                bool fits = memory + size <= fixture.end && model.is_free(memory, memory + size);
+                char *result = heap->allocate_at(memory, size);
+                if(result != (fits ? memory : nullptr))
+                    return fits ? "allocate_at() failed on free memory"
+                        : "allocate_at() succeeded on allocated memory";
+                if(result) {
+                    model.take(memory, memory + size);
+                    live.push_back({memory, size});
+                }
+            } else if(op < 9 && !live.empty()) {
+                Block &block = live[rand() % live.size()];
+                size_t size = random_size();
+                char *end = block.memory + block.size, *new_end = block.memory + size;
+                bool fits = new_end <= end || model.is_free(end, new_end);
+                char *result = heap->reallocate(block.memory, block.size, size);
+                if(result != (fits ? block.memory : nullptr))
+                    return fits ? "reallocate() failed to grow into free memory"
+                        : "reallocate() grew into allocated memory";
+                if(new_end < end)
+                    model.give(new_end, end);
+                else if(result && new_end > end)
+                    model.take(end, new_end);
+                if(result)
+                    block.size = size;
+            } else if(!live.empty()) {
+                size_t n = rand() % live.size();
+                Block block = live[n];
+                live[n] = live.back();
+                live.pop_back();
+                heap->deallocate(block.memory, block.size);
+                model.give(block.memory, block.memory + block.size);
+                // freeing it again should change nothing
+                if(op == 15) {
+                    heap->deallocate(block.memory, block.size);
+                    if(heap->available() != model.available())
+                        return "a double free was counted as free memory";
+                }
+            }
+
+            bool exact = step % 8 == 0;
+            if(exact)
+                heap->flush();
+            if(const char *failure = check(heap, model, exact))
+                return failure;
+        }
+
+        for(auto &block : live) {
+            heap->deallocate(block.memory, block.size);
+            model.give(block.memory, block.memory + block.size);
+        }
+        heap->flush();
+        if(const char *failure = check(heap, model, true))
+            return failure;
+        if(heap->count_chunks() != 1)
+            return "freeing everything didn't leave a single Chunk";
+        return nullptr;
+    }
+
+    /// a double free of a block small enough for a quick-list is ignored
+    bool test_quick_double_free(void) {
+        Fixture fixture;
+        Heap *heap = fixture.heap;
+        char *a = heap->allocate(UNIT), *b = heap->allocate(UNIT);
+        size_t available = heap->available();
+        heap->deallocate(a, UNIT);
+        heap->deallocate(a, UNIT);
+        bool passed = heap->available() == available + UNIT && heap->count_free() == available + UNIT;
+        // it must not be handed out twice either
+        char *c = heap->allocate(UNIT), *d = heap->allocate(UNIT);
+        passed = passed && c != d && heap->is_sane();
+        heap->deallocate(b, UNIT);
+        return passed;
+    }
+
+    /// the tail of a shrunk allocation merges with the free memory after it at once
+    bool test_reallocate_tail(void) {
+        Fixture fixture;
+        Heap *heap = fixture.heap;
+        char *memory = heap->allocate_at(fixture.start + 16 * UNIT, 16 * UNIT);
+        if(!memory || heap->count_chunks() != 2)
+            return false;
+        return heap->reallocate(memory, 16 * UNIT, 15 * UNIT) == memory
+            && heap->count_chunks() == 2 && heap->is_sane();
+    }
+}
+
+int main(void) {
+    const unsigned SEEDS = 4;
+    printf("1..%u\n", 2 * SEEDS + 2);
+
+    for(unsigned seed = 1; seed <= SEEDS; ++seed)
+        for(Heap::Policy policy : {Heap::POLICY_GOOD_FIT, Heap::POLICY_NEXT_FIT}) {
+            int step;
+            const char *failure = random_operations(seed, policy, step);
+            const char *name = policy == Heap::POLICY_GOOD_FIT ? "good fit" : "next fit";
+            if(!ok(!failure, "random operations match the model (seed %u, %s)", seed, name))
+                printf("# step %d: %s\n", step, failure);
+        }
+
+    ok(test_quick_double_free(), "a double free onto a quick-list is ignored");
+    ok(test_reallocate_tail(), "a reallocated tail merges at once");
+    return 0;
+}
@@ -0,0 +1,185 @@
+// -*- mode: c++ -*-
+/**
+   Tests that memory from the Chip RAM pages and extents of a MemoryState goes back to them by every
+   path.
+   \file
+
+   Small Chip RAM allocations are served from pages, and large allocations from extents at the
+   bottom of a Heap, both of which are inside the Heap's memory but not on its Chunk list. Whichever
+   way such memory is allocated and freed, AllocMem() and FreeMem() or AllocEntry() and FreeEntry(),
+   it must end up back in its page or the extent map rather than on the Chunk list, where it would
+   be owned twice.
+
+   The results are in TAP, for "make test".
+*/
+
+#include <exec/memory.hpp>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace exec;
+
+/** inserts a node in priority order; the ROM's version is in assembler, so isn't hosted
+    \param node_ the node to insert
+*/
+void List::enqueue(Node *node_) {
+    for(iterator i = begin(); i != end(); ++i)
+        if(i->priority < node_->priority)
+            return node_->insert_before(*i);
+    return push(node_);
+}
+
+namespace {
+    const size_t HEAP_SIZE = 1 << 20;
+    const size_t SMALL = 40;
+    const size_t LARGE = LargeObjects::DEFAULT_THRESHOLD + 100;
+    const unsigned ENTRIES = 3;
+
+    unsigned tests;
+
+    /** reports the result of a test
+        \param passed whether it passed
+        \param format printf() format of the test's description
+        \returns \a passed
+    */
+    bool ok(bool passed, const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        printf("%s %u - ", passed ? "ok" : "not ok", ++tests);
+        vprintf(format, args);
+        printf("\n");
+        va_end(args);
+        return passed;
+    }
+
+    /// a HeapList of one Heap, in memory of its own, and a MemoryState for it
+    class Fixture {
+    public:
+        char *base;
+        HeapList heaps;
+        Heap *heap;
+        MemoryState memory;
+        size_t start;           //!< the free memory of the new Heap
+
+        Fixture(Heap::Attributes attributes)
+            : base(static_cast<char *>(aligned_alloc(4096, HEAP_SIZE))), heaps(),
+              heap(Heap::create(HEAP_SIZE, attributes, 0, base, "test")),
+              memory(&heaps, 64, 64, 64, 64), start(heap->available()) {
+            heaps.add(heap);
+            memory.heap_table.rebuild();
+        }
+        ~Fixture(void) { free(base); }
+
+        /// \returns whether everything has been given back to the Heap, which is sane
+        bool is_empty(void) {
+            memory.large_objects.release();
+            heap->flush();
+            return heap->is_sane() && heap->available() == start && heap->count_chunks() == 1;
+        }
+    };
+
+    /// a request for AllocEntry(), with room for its entries
+    class Request {
+        alignas(MemEntry) char bytes[sizeof(MemEntry) + ENTRIES * sizeof(MemEntry::Entry)];
+    public:
+        Request(size_t size, Heap::Attributes attributes) {
+            MemEntry *entry = get();
+            entry->count = ENTRIES;
+            for(unsigned i = 0; i < ENTRIES; ++i) {
+                entry->entries[i].options = Heap::MEMF_NONE;
+                entry->entries[i].attributes = attributes;
+                entry->entries[i].size = size;
+            }
+        }
+        MemEntry *get(void) { return reinterpret_cast<MemEntry *>(bytes); }
+    };
+
+    /// large entries of AllocEntry() come from extents, and FreeEntry() gives them back to them
+    bool test_entry_extents(void) {
+        Fixture fixture(Heap::MEMF_PUBLIC);
+        Request request(LARGE, Heap::MEMF_PUBLIC);
+        MemEntryResponse response = fixture.heaps.allocate_multiple(request.get(), &fixture.memory);
+        if(response.failed)
+            return false;
+        char *addresses[ENTRIES];
+        bool passed = true;
+        for(unsigned i = 0; i < ENTRIES; ++i) {
+            addresses[i] = response.mementry->entries[i].addr;
+            passed = passed && fixture.memory.large_objects.contains(addresses[i]);
+        }
+        fixture.heaps.deallocate_multiple(response.mementry, &fixture.memory);
+        for(unsigned i = 0; i < ENTRIES; ++i)
+            passed = passed && !fixture.memory.large_objects.contains(addresses[i]);
+        return passed && fixture.is_empty();
+    }
+
+    /// small Chip RAM entries of AllocEntry() come from a page, and FreeEntry() gives them back to it
+    bool test_entry_chip_pages(void) {
+        Fixture fixture(Heap::Attributes(Heap::MEMF_CHIP | Heap::MEMF_PUBLIC));
+        Request request(SMALL, Heap::MEMF_CHIP);
+        MemEntryResponse response = fixture.heaps.allocate_multiple(request.get(), &fixture.memory);
+        if(response.failed)
+            return false;
+        char *addresses[ENTRIES];
+        bool passed = true;
+        for(unsigned i = 0; i < ENTRIES; ++i) {
+            addresses[i] = response.mementry->entries[i].addr;
+            passed = passed && fixture.memory.chip_pages.contains(addresses[i]);
+        }
+        fixture.heaps.deallocate_multiple(response.mementry, &fixture.memory);
+        // the granules are free again, and are the first to be handed out, not the Heap's
+        for(unsigned i = 0; i < ENTRIES; ++i) {
+            char *memory = fixture.memory.allocate(SMALL, Heap::MEMF_CHIP, Heap::MEMF_NONE);
+            passed = passed && memory == addresses[i];
+        }
+        return passed && fixture.heap->is_sane();
+    }
+
+    /// a MemEntry too long to sort on the stack is still all freed, whatever order it is in
+    bool test_entry_long(void) {
+        const unsigned COUNT = 500;
+        Fixture fixture(Heap::MEMF_PUBLIC);
+        MemEntry::Entry entries[COUNT];
+        for(unsigned i = 0; i < COUNT; ++i) {
+            entries[i].size = 64 * (1 + i % 5);
+            entries[i].addr = fixture.memory.allocate(entries[i].size, Heap::MEMF_PUBLIC,
+                                                      Heap::MEMF_NONE);
+            if(!entries[i].addr)
+                return false;
+        }
+        for(unsigned i = COUNT - 1; i > 0; --i) {
+            unsigned j = rand() % (i + 1);
+            MemEntry::Entry entry = entries[i];
+            entries[i] = entries[j];
+            entries[j] = entry;
+        }
+        fixture.heaps.deallocate_multiple(entries, COUNT, &fixture.memory);
+        return fixture.is_empty();
+    }
+
+    /// a large allocation that shrinks moves out of its extent, which is given back
+    bool test_reallocate_extent(void) {
+        Fixture fixture(Heap::MEMF_PUBLIC);
+        char *memory = fixture.memory.allocate(LARGE, Heap::MEMF_PUBLIC, Heap::MEMF_NONE);
+        if(!memory || !fixture.memory.large_objects.contains(memory))
+            return false;
+        memory[99] = 42;
+        char *moved = fixture.heaps.reallocate(memory, LARGE, 100, Heap::MEMF_PUBLIC,
+                                               Heap::MEMF_NONE, &fixture.memory);
+        bool passed = moved && moved[99] == 42 && !fixture.memory.large_objects.contains(moved)
+            && !fixture.memory.large_objects.contains(memory);
+        fixture.memory.deallocate(moved, 100);
+        return passed && fixture.is_empty();
+    }
+}
+
+int main(void) {
+    printf("1..4\n");
+    ok(test_entry_chip_pages(), "FreeEntry() gives small Chip RAM entries back to their page");
+    ok(test_entry_extents(), "FreeEntry() gives large entries back to their extents");
+    ok(test_entry_long(), "FreeEntry() frees a long MemEntry in any order");
+    ok(test_reallocate_extent(), "reallocating an extent moves it and gives the extent back");
+    return 0;
+}
@@ -0,0 +1,6 @@
+# -*- makefile -*-
+
+TESTMAINSRC += \
+	t/exec/heap_index.cpp \
+	t/exec/memory_state.cpp \
+